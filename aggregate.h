@@ -0,0 +1,150 @@
+/* Fused sort and aggregation: distinct keys with counts.
+ *
+ *   struct hq_agg_result agg;
+ *   hq_aggregate(&ctx, data, n, &agg);
+ *   ... agg.runs[0, agg.n) are (key, count) runs in key
+ *   order, at global run index agg.offset
+ *
+ * Equal keys are collapsed into runs before anything is
+ * exchanged: every rank sorts its keys and run-length
+ * encodes them. The hypercube levels then exchange runs
+ * instead of keys. The pivot of a level is the consensus
+ * of the ranks' median run keys, each rank splits its
+ * runs with a binary search, and the kept and received
+ * runs are merged, adding up the counts of equal keys.
+ * A key's runs always go to the same side of a pivot, so
+ * after the last level every key is held by one rank
+ * only and there is nothing to combine across ranks.
+ *
+ * A count that would pass UINT32_MAX is kept as more
+ * than one run of the same key, next to each other.
+ * The runs live in the context's exchange buffers, like
+ * the result of hq_sort().
+ */
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <mpi.h>
+#include <stdint.h>
+#include "hyperquicksort.h"
+
+/* One key and how many times it occurs, also the record of the output file */
+struct agg_run {
+	elem key;
+	uint32_t count;
+};
+
+/* Elements of the exchange buffers one run takes */
+#define AGG_RUN_ELEMS (sizeof(struct agg_run) / sizeof(elem))
+
+/* Runs held by this rank after hq_aggregate() */
+struct hq_agg_result {
+	struct agg_run* runs;
+	size_t n;
+
+	/* Index of runs[0] among the runs of all ranks */
+	size_t offset;
+
+	/* Runs this rank sent over all levels */
+	uint64_t sent;
+};
+
+/* Exchange buffer i with room for n runs */
+struct agg_run* hq_agg_buffer(struct hq_context* ctx, int i, size_t n) {
+	return (struct agg_run*)hq_buffer(ctx, i, n * AGG_RUN_ELEMS);
+}
+
+/* Append (key, count) to out[0, *n), adding to the last run if it has the same key */
+void agg_push(struct agg_run* out, size_t* n, elem key, uint32_t count) {
+	if (*n > 0 && out[*n - 1].key == key && out[*n - 1].count <= UINT32_MAX - count) {
+		out[*n - 1].count += count;
+	} else {
+		out[*n].key = key;
+		out[*n].count = count;
+		++(*n);
+	}
+}
+
+/* Merge the runs a[0, an) and b[0, bn) into out, which may
+ * start at b - an (b is read ahead of every write), and
+ * return the number of runs written
+ */
+size_t agg_merge(const struct agg_run* a, size_t an, const struct agg_run* b, size_t bn, struct agg_run* out) {
+	size_t x = 0;
+	size_t y = 0;
+	size_t o = 0;
+	while (x < an || y < bn) {
+		const struct agg_run* next = (y == bn || (x < an && a[x].key <= b[y].key)) ? &a[x++] : &b[y++];
+		struct agg_run r = *next;
+		agg_push(out, &o, r.key, r.count);
+	}
+	return o;
+}
+
+void hq_aggregate(struct hq_context* ctx, elem* data, size_t n, struct hq_agg_result* res) {
+	res->sent = 0;
+
+	/* Pre-combine: sort locally and collapse equal keys */
+	if (n > 0) {
+		ctx->backend->sort(data, data + n - 1);
+	}
+	size_t runs = 0;
+	for (size_t i = 0; i < n; ++i) {
+		runs += (i == 0 || data[i] != data[i - 1]);
+	}
+	int b = 0;
+	struct agg_run* cur = hq_agg_buffer(ctx, b, runs);
+	size_t cur_n = 0;
+	for (size_t i = 0; i < n; ++i) {
+		agg_push(cur, &cur_n, data[i], 1);
+	}
+
+	for (int level = 0; level < ctx->levels; ++level) {
+		MPI_Comm comm = ctx->level_comms[level];
+		int localNumranks = ctx->numranks >> level;
+		int localRank = ctx->rank % localNumranks;
+
+		elem median = cur_n > 0 ? cur[cur_n / 2].key : 0;
+		elem pv = hq_consensus_median(ctx, comm, localRank, localNumranks, &median, cur_n > 0);
+
+		/* Runs with key <= pv are [0, mid) */
+		size_t mid = 0;
+		size_t hi = cur_n;
+		while (mid < hi) {
+			size_t m = mid + (hi - mid) / 2;
+			if (cur[m].key <= pv) {
+				mid = m + 1;
+			} else {
+				hi = m;
+			}
+		}
+
+		const int color = (localRank >= (localNumranks >> 1));
+		int src_rank = color ? localRank - (localNumranks >> 1) : localRank + (localNumranks >> 1);
+		struct agg_run* keep_arr = color ? cur + mid : cur;
+		size_t keep_size = color ? cur_n - mid : mid;
+		struct agg_run* send_arr = color ? cur : cur + mid;
+		size_t send_size = color ? mid : cur_n - mid;
+
+		size_t recv_bytes;
+		size_t recv_size = hq_exchange_size(ctx, comm, src_rank, send_size * AGG_RUN_ELEMS, 0, &recv_bytes)
+				/ AGG_RUN_ELEMS;
+
+		/* Received runs go to the tail of the other buffer and are merged forward */
+		struct agg_run* next = hq_agg_buffer(ctx, 1 - b, keep_size + recv_size);
+		hq_exchange(ctx, comm, src_rank, (elem*)send_arr, send_size * AGG_RUN_ELEMS, 0,
+				(elem*)(next + keep_size), recv_size * AGG_RUN_ELEMS, 0);
+		res->sent += send_size;
+
+		cur_n = agg_merge(keep_arr, keep_size, next + keep_size, recv_size, next);
+		cur = next;
+		b = 1 - b;
+	}
+
+	res->runs = cur;
+	res->n = cur_n;
+	res->offset = hq_offset(ctx, cur_n);
+}
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Microbenchmarks for the serial_sort.h kernels
+ * (partition, findKth, m_qsort, split_array,
+ * split_in_place, m_radix_sort) against the libc
+ * qsort and std::sort reference sorts.
+ *
+ * Every kernel is timed on each input shape for sizes
+ * 1K, 10K, ... up to the maximum size and reported in
+ * nanoseconds and cycles per element, best of reps.
+ * The input is copied back from a pristine array before
+ * every repetition, outside of the timed region.
+ *
+ * Each measurement runs in a forked child, so a kernel
+ * that overflows its stack on a degenerate shape is
+ * reported as CRASHED and one that runs past the time
+ * limit as TIMEOUT, instead of ending the whole run.
+ * Larger sizes of that shape are then SKIPPED for the
+ * kernel.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "./serial_sort.h"
+#include "./cpp_sort_api.h"
+#include "./cycle_clock.h"
+
+#define MIN_SIZE 1000
+#define DEFAULT_MAX_SIZE 100000000
+#define DEFAULT_REPS 3
+#define DEFAULT_TIME_LIMIT 60
+
+enum kernel { K_PARTITION, K_FINDKTH, K_MQSORT, K_SPLIT, K_SPLIT_IN_PLACE, K_RADIX, K_LIBC_QSORT, K_STD_SORT, NUM_KERNELS };
+const char* kernel_names[NUM_KERNELS] = { "partition", "findKth", "m_qsort", "split_array", "split_in_pl", "m_radix", "qsort", "std::sort" };
+
+enum shape { S_RANDOM, S_SORTED, S_REVERSE, S_ALLEQUAL, S_FEWUNIQUE, S_ORGANPIPE, NUM_SHAPES };
+const char* shape_names[NUM_SHAPES] = { "random", "sorted", "reverse", "all-equal", "few-unique", "organ-pipe" };
+
+/* Number of distinct keys in the few-unique shape */
+#define FEW_UNIQUE_KEYS 16
+
+/* Result of one measurement, passed from child to parent */
+struct measurement {
+	double ns_per_elem;
+	double cycles_per_elem;
+};
+
+/* xorshift64, fixed seed so every run sees the same inputs */
+unsigned long long rng_state;
+
+unsigned long long xorshift64() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+void fill_shape(elem* arr, size_t n, enum shape s) {
+	rng_state = 0x9E3779B97F4A7C15ULL ^ n;
+	for (size_t i = 0; i < n; ++i) {
+		switch (s) {
+			case S_RANDOM:     arr[i] = (elem)(xorshift64() >> 33); break;
+			case S_SORTED:     arr[i] = (elem)i; break;
+			case S_REVERSE:    arr[i] = (elem)(n - i); break;
+			case S_ALLEQUAL:   arr[i] = 42; break;
+			case S_FEWUNIQUE:  arr[i] = (elem)(xorshift64() % FEW_UNIQUE_KEYS); break;
+			case S_ORGANPIPE:  arr[i] = (elem)(i < n / 2 ? i : n - i); break;
+			default: break;
+		}
+	}
+}
+
+int qsort_cmp(const void* a, const void* b) {
+	return cmp((elem*)a, (elem*)b);
+}
+
+/* Run one kernel over work[0, n), pivot is used by partition/split_array */
+void run_kernel(enum kernel k, elem* work, size_t n, elem pivot) {
+	elem* l_arr;
+	elem* r_arr;
+	size_t l_sz;
+	size_t r_sz;
+	switch (k) {
+		case K_PARTITION:
+			partition(work, work + n - 1, pivot);
+			break;
+		case K_FINDKTH:
+			findKth(work, work + n - 1, n / 2);
+			break;
+		case K_MQSORT:
+			m_qsort(work, work + n - 1);
+			break;
+		case K_SPLIT:
+			split_array(work, work + n - 1, &l_arr, &l_sz, &r_arr, &r_sz, pivot);
+			free(l_arr);
+			free(r_arr);
+			break;
+		case K_SPLIT_IN_PLACE:
+			split_in_place(work, work + n - 1, pivot);
+			break;
+		case K_RADIX:
+			m_radix_sort(work, work + n - 1);
+			break;
+		case K_LIBC_QSORT:
+			qsort(work, n, sizeof(elem), qsort_cmp);
+			break;
+		case K_STD_SORT:
+			CPP_StdSort(work, work + n - 1);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Best of reps, run in the calling (child) process */
+struct measurement measure(enum kernel k, const elem* pristine, size_t n, int reps) {
+	struct measurement best = { -1.0, -1.0 };
+	elem* work = (elem*)malloc(n * sizeof(elem));
+	if (work == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Pivot of partition/split_array is an element of the input */
+	elem pivot = pristine[n / 3];
+	srand(1);
+	for (int rep = 0; rep < reps; ++rep) {
+		memcpy(work, pristine, n * sizeof(elem));
+		unsigned long long ns0 = nsec_clock_read();
+		unsigned long long cy0 = cycle_clock_read();
+		run_kernel(k, work, n, pivot);
+		unsigned long long cy1 = cycle_clock_read();
+		unsigned long long ns1 = nsec_clock_read();
+		double ns = (double)(ns1 - ns0) / n;
+		double cy = (double)(cy1 - cy0) / n;
+		if (best.ns_per_elem < 0 || ns < best.ns_per_elem) {
+			best.ns_per_elem = ns;
+			best.cycles_per_elem = cy;
+		}
+	}
+	free(work);
+	return best;
+}
+
+/* usage [ executable ] [ max size ] [ repetitions ] [ time limit secs ] */
+int main(int argc, char** argv) {
+	if (argc > 4) {
+		fprintf(stderr, "ERROR: invalid argument(s)\n");
+		fprintf(stderr, "USAGE: [ executable ] [ max size ] [ repetitions ] [ time limit secs ]\n");
+		return EXIT_FAILURE;
+	}
+	size_t max_n = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_MAX_SIZE;
+	int reps = argc > 2 ? atoi(argv[2]) : DEFAULT_REPS;
+	int time_limit = argc > 3 ? atoi(argv[3]) : DEFAULT_TIME_LIMIT;
+	if (max_n < MIN_SIZE || reps < 1 || time_limit < 1) {
+		fprintf(stderr, "ERROR: max size must be >= %d, repetitions and time limit >= 1\n", MIN_SIZE);
+		return EXIT_FAILURE;
+	}
+
+	elem* pristine = (elem*)malloc(max_n * sizeof(elem));
+	if (pristine == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-12s %-11s %12s %12s %14s\n", "KERNEL", "SHAPE", "N", "NS/ELEM", "CYCLES/ELEM");
+	fflush(NULL);
+
+	for (int s = 0; s < NUM_SHAPES; ++s) {
+		int skip[NUM_KERNELS] = { 0 };
+		for (size_t n = MIN_SIZE; n <= max_n; n *= 10) {
+			fill_shape(pristine, n, (enum shape)s);
+			for (int k = 0; k < NUM_KERNELS; ++k) {
+				if (skip[k]) {
+					printf("%-12s %-11s %12zu %12s\n", kernel_names[k], shape_names[s], n, "SKIPPED");
+					continue;
+				}
+
+				int p[2];
+				if (pipe(p) == -1) {
+					perror("ERROR: pipe() failed");
+					return EXIT_FAILURE;
+				}
+				pid_t pid = fork();
+				if (pid == -1) {
+					perror("ERROR: fork() failed");
+					return EXIT_FAILURE;
+				}
+				if (pid == 0) { /* Child */
+					close(p[0]);
+					alarm(time_limit);
+					struct measurement m = measure((enum kernel)k, pristine, n, reps);
+					if (write(p[1], &m, sizeof(m)) != sizeof(m)) {
+						perror("ERROR: write() failed");
+						_exit(EXIT_FAILURE);
+					}
+					_exit(EXIT_SUCCESS);
+				}
+
+				close(p[1]);
+				struct measurement m;
+				ssize_t got = read(p[0], &m, sizeof(m));
+				close(p[0]);
+				int status;
+				if (waitpid(pid, &status, 0) == -1) {
+					perror("ERROR: waitpid() failed");
+					return EXIT_FAILURE;
+				}
+
+				if (got == sizeof(m) && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+					printf("%-12s %-11s %12zu %12.3f %14.3f\n", kernel_names[k], shape_names[s], n,
+							m.ns_per_elem, m.cycles_per_elem);
+				} else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+					printf("%-12s %-11s %12zu %12s\n", kernel_names[k], shape_names[s], n, "TIMEOUT");
+					skip[k] = 1;
+				} else {
+					printf("%-12s %-11s %12zu %12s\n", kernel_names[k], shape_names[s], n, "CRASHED");
+					skip[k] = 1;
+				}
+				fflush(NULL);
+			}
+		}
+	}
+
+	free(pristine);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+/* Frame-of-reference bit packing for exchanged keys.
+ *
+ * Keys are cut into blocks of CODEC_BLOCK. Each block
+ * stores its minimum and the number of bits needed for
+ * (key - minimum), then every key in that many bits.
+ * The keys do not have to be sorted, only close in
+ * value, which is what a small key range gives us.
+ *
+ * Decoding reads every key with one unaligned 64 bit
+ * load at a position computed from its index, so the
+ * loop has no dependency between keys and vectorizes.
+ * It may read up to 8 bytes past the encoded data, so
+ * buffers are sized with codec_bound().
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include "serial_sort.h"
+
+#define CODEC_BLOCK 128
+
+/* Block header: minimum (4 bytes) and bit width (1 byte) */
+#define CODEC_HEADER 5
+
+/* Largest encoding of n keys, including the decoder's read slack */
+size_t codec_bound(size_t n) {
+	size_t blocks = (n + CODEC_BLOCK - 1) / CODEC_BLOCK;
+	return blocks * CODEC_HEADER + n * sizeof(elem) + 8;
+}
+
+/* Bits needed for values up to range */
+int codec_bits(uint32_t range) {
+	return range == 0 ? 0 : 32 - __builtin_clz(range);
+}
+
+/* Minimum and bit width of one block */
+int codec_block_bits(const elem* in, size_t len, elem* min_out) {
+	elem lo = in[0];
+	elem hi = in[0];
+	for (size_t i = 1; i < len; ++i) {
+		lo = in[i] < lo ? in[i] : lo;
+		hi = in[i] > hi ? in[i] : hi;
+	}
+	*min_out = lo;
+	return codec_bits((uint32_t)hi - (uint32_t)lo);
+}
+
+/* Encode n keys into out, returns the encoded size in bytes */
+size_t codec_encode(const elem* in, size_t n, unsigned char* out) {
+	unsigned char* p = out;
+	for (size_t b = 0; b < n; b += CODEC_BLOCK) {
+		size_t len = n - b < CODEC_BLOCK ? n - b : CODEC_BLOCK;
+		elem lo;
+		int bits = codec_block_bits(in + b, len, &lo);
+		memcpy(p, &lo, sizeof(elem));
+		p[4] = (unsigned char)bits;
+		p += CODEC_HEADER;
+
+		uint64_t acc = 0;
+		int nb = 0;
+		for (size_t i = 0; i < len; ++i) {
+			acc |= (uint64_t)((uint32_t)in[b + i] - (uint32_t)lo) << nb;
+			nb += bits;
+			if (nb >= 32) {
+				uint32_t word = (uint32_t)acc;
+				memcpy(p, &word, sizeof(word));
+				p += sizeof(word);
+				acc >>= 32;
+				nb -= 32;
+			}
+		}
+		for (; nb > 0; nb -= 8) {
+			*(p++) = (unsigned char)acc;
+			acc >>= 8;
+		}
+	}
+	return p - out;
+}
+
+/* Decode n keys encoded by codec_encode() */
+void codec_decode(const unsigned char* in, size_t n, elem* out) {
+	const unsigned char* p = in;
+	for (size_t b = 0; b < n; b += CODEC_BLOCK) {
+		size_t len = n - b < CODEC_BLOCK ? n - b : CODEC_BLOCK;
+		elem lo;
+		memcpy(&lo, p, sizeof(elem));
+		int bits = p[4];
+		p += CODEC_HEADER;
+
+		uint64_t mask = bits == 32 ? 0xFFFFFFFFULL : ((1ULL << bits) - 1);
+		for (size_t i = 0; i < len; ++i) {
+			size_t pos = i * bits;
+			uint64_t word;
+			memcpy(&word, p + (pos >> 3), sizeof(word));
+			out[b + i] = (elem)((uint32_t)lo + (uint32_t)((word >> (pos & 7)) & mask));
+		}
+		p += (len * bits + 7) / 8;
+	}
+}
+
+/* Estimated encoded/raw size ratio of n keys from
+ * up to samples blocks spread over the input
+ */
+double codec_estimate_ratio(const elem* in, size_t n, int samples) {
+	size_t blocks = (n + CODEC_BLOCK - 1) / CODEC_BLOCK;
+	if (blocks == 0) {
+		return 1.0;
+	}
+	size_t step = blocks > (size_t)samples ? blocks / samples : 1;
+	size_t bits = 0;
+	size_t seen = 0;
+	for (size_t blk = 0; blk < blocks; blk += step, ++seen) {
+		size_t b = blk * CODEC_BLOCK;
+		size_t len = n - b < CODEC_BLOCK ? n - b : CODEC_BLOCK;
+		elem lo;
+		bits += codec_block_bits(in + b, len, &lo);
+	}
+	double bytes_per_key = (double)CODEC_HEADER / CODEC_BLOCK + (double)bits / seen / 8;
+	return bytes_per_key / sizeof(elem);
+}
+
+#endif
@@ -0,0 +1,22 @@
+#include <algorithm>
+#include "./serial_sort.h"
+
+extern "C" {
+	void CPP_StdSort(elem* begin, elem* end);
+	elem CPP_NthElement(elem* begin, elem* end, size_t k);
+	elem* CPP_Partition(elem* begin, elem* end, elem pv);
+}
+
+void CPP_StdSort(elem* begin, elem* end) {
+	std::sort(begin, end + 1);
+}
+
+elem CPP_NthElement(elem* begin, elem* end, size_t k) {
+	elem* nth = begin + (k > 0 ? k - 1 : 0);
+	std::nth_element(begin, nth, end + 1);
+	return *nth;
+}
+
+elem* CPP_Partition(elem* begin, elem* end, elem pv) {
+	return std::partition(begin, end + 1, [pv](elem x) { return x <= pv; });
+}
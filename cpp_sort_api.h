@@ -0,0 +1,18 @@
+#ifndef CPP_SORT_API_H
+#define CPP_SORT_API_H
+
+#include "serial_sort.h"
+
+/* std::sort over [begin, end], both inclusive */
+extern void CPP_StdSort(elem* begin, elem* end);
+
+/* std::nth_element over [begin, end], returns the
+ * kth smallest element counting from 1 (like findKth)
+ */
+extern elem CPP_NthElement(elem* begin, elem* end, size_t k);
+
+/* std::partition of [begin, end] about pv, same
+ * result as split_in_place()
+ */
+extern elem* CPP_Partition(elem* begin, elem* end, elem pv);
+#endif
@@ -3,7 +3,7 @@
 
 #include "serial_sort.h"
 
-extern void CU_Init();
+extern void CU_Init(int world_rank, int world_size);
 extern elem* CU_cudaAlloc(size_t byte);
 extern void CU_cudaFree(elem* ptr);
 extern void CU_OddEvenNetworkSort(elem* begin, elem* end);
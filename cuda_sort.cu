@@ -3,7 +3,7 @@
 #include "./serial_sort.h"
 
 extern "C" {
-	void CU_Init();
+	void CU_Init(int world_rank, int world_size);
 	elem* CU_cudaAlloc(size_t bytes);
 	void CU_cudaFree(elem* ptr);
 	void CU_OddEvenNetworkSort(elem* begin, elem* end);
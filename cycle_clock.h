@@ -0,0 +1,75 @@
+/* Timing helpers shared by the sort and the benchmarks.
+ *
+ * aimos_clock_read() is the free running clock the
+ * sort reports its execution time with, and
+ * CLOCKS_PER_MSEC converts its ticks to milliseconds.
+ *
+ * cycle_clock_read() reads the cheapest cycle-like
+ * counter of the machine (timebase on POWER, TSC on
+ * x86) for per-element cycle counts.
+ *
+ * Files including this header must define
+ * _POSIX_C_SOURCE (or _XOPEN_SOURCE) before their
+ * first system header so clock_gettime() is visible.
+ */
+
+#ifndef CYCLE_CLOCK_H
+#define CYCLE_CLOCK_H
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Nanoseconds from a monotonic clock */
+unsigned long long nsec_clock_read(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__powerpc__) || defined(__powerpc64__)
+
+#define CLOCKS_PER_MSEC 512000
+
+/*
+ * 64 bit, free running clock for POWER9/AiMOS system
+ *  Has 512MHz resolution.
+ */
+unsigned long long aimos_clock_read(void) {
+  unsigned int tbl, tbu0, tbu1;
+  do {
+    __asm__ __volatile__("mftbu %0" : "=r"(tbu0));
+    __asm__ __volatile__("mftb %0" : "=r"(tbl));
+    __asm__ __volatile__("mftbu %0" : "=r"(tbu1));
+  } while (tbu0 != tbu1);
+  return (((unsigned long long)tbu0) << 32) | tbl;
+}
+
+unsigned long long cycle_clock_read(void) {
+	return aimos_clock_read();
+}
+
+#else
+
+/* Off POWER the execution time is kept in nanoseconds */
+#define CLOCKS_PER_MSEC 1000000
+
+unsigned long long aimos_clock_read(void) {
+	return nsec_clock_read();
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+unsigned long long cycle_clock_read(void) {
+	return __rdtsc();
+}
+#else
+unsigned long long cycle_clock_read(void) {
+	return nsec_clock_read();
+}
+#endif
+
+#endif
+
+#endif
@@ -1,23 +1,33 @@
 /*
- * Includes code to generate a random set of 
- * numbers and writes them to a file. Might 
- * want to parallelize this later for larger
- * data sets
+ * Includes code to generate a random set of
+ * numbers and writes them to a file.
+ *
+ * Element i is a pure function of (seed, i): each
+ * value comes from a Philox counter-based generator
+ * keyed by the seed with i as the counter, so the
+ * output is identical for any number of threads.
+ * Every thread generates a disjoint range of the
+ * file into its own large buffer and pwrite()s it
+ * at that range's offset.
  */
 
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
 #include "./serial_sort.h"
+#include "./philox.h"
 
-#define BUFF_SZ 1024
+/* elements per thread write buffer (4 MB) */
+#define BUFF_SZ (1 << 20)
 
 /* lower bound */
 elem lb;
@@ -26,7 +36,7 @@ elem lb;
 elem ub;
 
 /* number of numbers */
-ssize_t n;
+int64_t n;
 
 /* file path */
 char* fpath;
@@ -34,169 +44,410 @@ char* fpath;
 /* distribution shape */
 char* distribution;
 
+/* generator seed */
+uint64_t seed;
+
+/* Philox key derived from the seed */
+philox_key key;
+
+/* number of generator threads */
+int nthreads;
+
 /* file descriptor */
 int fd;
 
 /* return code */
 int rc;
 
-/* write buffer */
-elem* wbuff;
+/* distribution parameter (-p), meaning depends on the distribution */
+double param;
+int param_set = 0;
 
-/* normal constants */
-elem norm2;
-int done = 0;
+/* key range size ub - lb + 1 */
+double range;
 
-/* exponential constants */
-const double lambda = 0.01;
+/* normal standard deviation */
+double sigma;
 
-ssize_t min(ssize_t a, ssize_t b) { return a < b ? a : b; }
+/* exponential rate */
+double lambda;
 
-elem (*genPtr)();
+/* sawtooth period, few-unique key count, interleaved slice count */
+int64_t period;
 
-elem get_uniform() {
-	return ((elem)rand()) % (ub - lb + 1) + lb;
-}	
+/* zipf exponent and rejection-inversion constants */
+double zipf_s;
+double zipf_hx1;
+double zipf_hn;
+double zipf_sc;
 
-elem get_normal() {
-#if 0
-	if (done) {
-		done = 0;
-		return norm2;
-	}
+int64_t min(int64_t a, int64_t b) { return a < b ? a : b; }
 
-	double x,y,rsq,f;
-	do {
-		x = 2.0 * rand() / (double)RAND_MAX - 1.0;
-    y = 2.0 * rand() / (double)RAND_MAX - 1.0;
-		rsq = x * x + y * y;
-	} while (rsq >= 1. || rsq == 0.);
-	f = sqrt(-2.0 * log(rsq)/rsq);
-	norm2 = (elem)((y * f * (double)(ub - lb)) + ((double)(lb) + ((double)(ub - lb))/2));
-	done = 1;
-	return (elem)((x * f * (double)(ub - lb)) + ((double)(lb) + ((double)(ub - lb))/2));
-#endif
+elem (*genPtr)(int64_t i);
+
+/* Key at rank pos of n evenly spread over [lb, ub], non-decreasing in pos */
+elem get_ramp(int64_t pos, int64_t cnt) {
+	int64_t off = (int64_t)floor((double)pos * (range / (double)cnt));
+	return (elem)((int64_t)lb + min(off, (int64_t)range - 1));
+}
 
-	double x = (double)rand() / RAND_MAX;
-	double y = (double)rand() / RAND_MAX;
-	double z = sqrt(-2 * log(x)) * cos(2 * M_PI * y);
+elem get_uniform(int64_t i) {
+	philox_ctr r = philox_draw(key, i, 0);
+	uint64_t range = (uint64_t)((int64_t)ub - lb + 1);
+	return (elem)((int64_t)lb + (int64_t)(philox_u64(r.v[0], r.v[1]) % range));
+}
+
+/* Normal around the middle of the range, redrawn until it falls in [lb, ub] */
+elem get_normal(int64_t i) {
 	double lb_dbl = lb;
 	double ub_dbl = ub;
-	return (elem)(z * (ub_dbl - lb_dbl) + (lb_dbl + (ub_dbl - lb_dbl)/2));
+	double res = ub_dbl + 1;
+	for (uint32_t draw = 0; res < lb_dbl || res > ub_dbl; ++draw) {
+		philox_ctr r = philox_draw(key, i, draw);
+		double x = philox_u01(r.v[0]);
+		double y = philox_u01(r.v[1]);
+		double z = sqrt(-2 * log(x)) * cos(2 * M_PI * y);
+		res = floor(z * sigma + (lb_dbl + (ub_dbl - lb_dbl)/2) + 0.5);
+	}
+	return (elem)res;
+}
+
+/* Exponential from lb truncated at ub, by inverting its CDF */
+elem get_exp(int64_t i) {
+	philox_ctr r = philox_draw(key, i, 0);
+	double u = philox_u01(r.v[0]);
+	double x = floor(-log1p(-u * -expm1(-lambda * range)) / lambda);
+	return (elem)((int64_t)lb + min((int64_t)x, (int64_t)range - 1));
+}
+
+elem get_sorted(int64_t i) {
+	return get_ramp(i, n);
+}
+
+elem get_reverse(int64_t i) {
+	return get_ramp(n - 1 - i, n);
+}
+
+elem get_sawtooth(int64_t i) {
+	return get_ramp(i % period, period);
+}
+
+elem get_organpipe(int64_t i) {
+	int64_t half = (n + 1) / 2;
+	return get_ramp(i < half ? i : n - 1 - i, half);
+}
+
+elem get_fewunique(int64_t i) {
+	philox_ctr r = philox_draw(key, i, 0);
+	return get_ramp((int64_t)(philox_u64(r.v[0], r.v[1]) % period), period);
+}
+
+elem get_allequal(int64_t i) {
+	return lb;
 }
 
-elem get_exp() {
-	double res = INT_MAX;
-	while (res > (double)ub) {
-		res = lb + floor(-log(drand48()) / lambda); 
+/* Helpers of the zipf sampler, stable around x = 0 */
+double zipf_helper1(double x) {
+	return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+double zipf_helper2(double x) {
+	return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x / 2 * (1 + x / 3 * (1 + x / 4));
+}
+
+double zipf_h(double x) {
+	return exp(-zipf_s * log(x));
+}
+
+double zipf_hintegral(double x) {
+	double lx = log(x);
+	return zipf_helper2((1 - zipf_s) * lx) * lx;
+}
+
+double zipf_hintegral_inv(double x) {
+	double t = x * (1 - zipf_s);
+	if (t < -1) {
+		t = -1;
 	}
-	return (elem)res;
+	return exp(zipf_helper1(t) * x);
+}
+
+/* Zipf over the ranks 1..range, rank k becomes key lb + k - 1.
+ * Rejection-inversion (Hormann & Derflinger, 1996), no tables.
+ */
+elem get_zipf(int64_t i) {
+	for (uint32_t draw = 0; ; ++draw) {
+		philox_ctr r = philox_draw(key, i, draw);
+		double u = zipf_hn + philox_u01(r.v[0]) * (zipf_hx1 - zipf_hn);
+		double x = zipf_hintegral_inv(u);
+		double k = floor(x + 0.5);
+		if (k < 1) {
+			k = 1;
+		} else if (k > range) {
+			k = range;
+		}
+		if (k - x <= zipf_sc || u >= zipf_hintegral(k + 0.5) - zipf_h(k)) {
+			return (elem)((int64_t)lb + (int64_t)k - 1);
+		}
+	}
+}
+
+/* period slices cut like readfile() does for period ranks; each
+ * slice is sorted, and slice r holds the global ranks r, r + period, ...
+ */
+elem get_interleaved(int64_t i) {
+	int64_t delta = n / period;
+	int64_t slice = delta > 0 ? min(i / delta, period - 1) : 0;
+	int64_t j = i - slice * delta;
+	return get_ramp(min(j * period + slice, n - 1), n);
+}
+
+/* Range of elements one thread generates */
+struct gen_task {
+	int64_t begin;
+	int64_t end;
+	int failed;
+};
+
+void* gen_range(void* arg) {
+	struct gen_task* task = (struct gen_task*)arg;
+	elem* wbuff = (elem *) malloc((BUFF_SZ * sizeof(elem)));
+	if (wbuff == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		task->failed = 1;
+		return NULL;
+	}
+
+	for (int64_t i = task->begin; i < task->end; i += BUFF_SZ) {
+		int64_t num_elems = min(BUFF_SZ, task->end - i);
+		for (int64_t j = 0; j < num_elems; ++j) {
+			wbuff[j] = (*genPtr)(i + j);
+		}
+
+		/* pwrite() may write less than asked for */
+		char* src = (char*)wbuff;
+		size_t left = num_elems * sizeof(elem);
+		off_t at = (off_t)i * sizeof(elem);
+		while (left > 0) {
+			ssize_t wr = pwrite(fd, src, left, at);
+			if (wr == -1) {
+				perror("ERROR: pwrite() failed");
+				task->failed = 1;
+				free(wbuff);
+				return NULL;
+			}
+			src += wr;
+			at += wr;
+			left -= wr;
+		}
+	}
+
+	free(wbuff);
+	return NULL;
 }
 
-/* usage [ executable ] [ lowest number ] [ highest number ] [ number of points ] [ distribution ] [ fpath ] */
+void usage() {
+	fprintf(stderr, "USAGE: [ executable ] [ -s seed ] [ -t threads ] [ -p param ] [ lowest number ] [ highest number ] [ number of points ] [ distribution ] [ fpath ]\n");
+	fprintf(stderr, "distributions (-p meaning, default):\n");
+	fprintf(stderr, "  uniform\n");
+	fprintf(stderr, "  normal       (standard deviation, range/6)\n");
+	fprintf(stderr, "  exponential  (rate, 0.01)\n");
+	fprintf(stderr, "  sorted\n");
+	fprintf(stderr, "  reverse\n");
+	fprintf(stderr, "  sawtooth     (period, 1000)\n");
+	fprintf(stderr, "  organpipe\n");
+	fprintf(stderr, "  fewunique    (number of distinct keys, 16)\n");
+	fprintf(stderr, "  allequal\n");
+	fprintf(stderr, "  zipf         (exponent, 1.0)\n");
+	fprintf(stderr, "  interleaved  (number of sorted slices i.e. ranks, 16)\n");
+}
+
+/* usage [ executable ] [ -s seed ] [ -t threads ] [ -p param ] [ lowest number ] [ highest number ] [ number of points ] [ distribution ] [ fpath ] */
 int main(int argc, char** argv) {
-	if (argc != 6) {
+	seed = (uint64_t)time(0);
+	nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	int opt;
+	char* endp;
+	while ((opt = getopt(argc, argv, "s:t:p:")) != -1) {
+		switch (opt) {
+			case 's':
+				seed = strtoull(optarg, &endp, 10);
+				if (*endp != '\0') {
+					fprintf(stderr, "ERROR: invalid seed %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				if (nthreads < 1) {
+					fprintf(stderr, "ERROR: invalid thread count %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'p':
+				param = strtod(optarg, &endp);
+				if (*endp != '\0') {
+					fprintf(stderr, "ERROR: invalid parameter %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				param_set = 1;
+				break;
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 5) {
 		fprintf(stderr, "ERROR: invalid argument(s)\n");
-		fprintf(stderr, "USAGE: [ executable ] [ lowest number ] [ highest number ] [ number of points ] [ distribution ] [ fpath ]\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+	argv += optind;
+
+	lb    = atoi(argv[0]);
+	ub    = atoi(argv[1]);
+	n     = strtoll(argv[2], &endp, 10);
+	distribution = argv[3];
+	fpath = argv[4];
+
+	if (*endp != '\0' || n < 0) {
+		fprintf(stderr, "ERROR: invalid number of points %s\n", argv[2]);
 		return EXIT_FAILURE;
 	}
-	
-	srand48(time(0));
-	lb    = atoi(argv[1]);
-	ub    = atoi(argv[2]);
-	n     = atoi(argv[3]);
-	distribution = argv[4];
-	fpath = argv[5];
-	
+	if (lb > ub) {
+		fprintf(stderr, "ERROR: lowest number is larger than highest number\n");
+		return EXIT_FAILURE;
+	}
+
+	range = (double)((int64_t)ub - lb + 1);
+
 	if (0 == strcmp(distribution, "uniform")) {
 		genPtr = &get_uniform;
 	} else if (0 == strcmp(distribution, "normal")) {
+		sigma = param_set ? param : (range - 1) / 6;
 		genPtr = &get_normal;
 	} else if (0 == strcmp(distribution, "exponential")) {
+		lambda = param_set ? param : 0.01;
 		genPtr = &get_exp;
+	} else if (0 == strcmp(distribution, "sorted")) {
+		genPtr = &get_sorted;
+	} else if (0 == strcmp(distribution, "reverse")) {
+		genPtr = &get_reverse;
+	} else if (0 == strcmp(distribution, "sawtooth")) {
+		period = param_set ? (int64_t)param : 1000;
+		genPtr = &get_sawtooth;
+	} else if (0 == strcmp(distribution, "organpipe")) {
+		genPtr = &get_organpipe;
+	} else if (0 == strcmp(distribution, "fewunique")) {
+		period = param_set ? (int64_t)param : 16;
+		genPtr = &get_fewunique;
+	} else if (0 == strcmp(distribution, "allequal")) {
+		genPtr = &get_allequal;
+	} else if (0 == strcmp(distribution, "zipf")) {
+		zipf_s = param_set ? param : 1.0;
+		zipf_hx1 = zipf_hintegral(1.5) - 1;
+		zipf_hn = zipf_hintegral(range + 0.5);
+		zipf_sc = 2 - zipf_hintegral_inv(zipf_hintegral(2.5) - zipf_h(2));
+		genPtr = &get_zipf;
+	} else if (0 == strcmp(distribution, "interleaved")) {
+		period = param_set ? (int64_t)param : 16;
+		genPtr = &get_interleaved;
 	} else {
 		fprintf(stderr, "ERROR: unknown distribution\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if ((genPtr == &get_normal && sigma <= 0) || (genPtr == &get_exp && lambda <= 0)
+			|| (genPtr == &get_zipf && zipf_s <= 0)
+			|| ((genPtr == &get_sawtooth || genPtr == &get_fewunique || genPtr == &get_interleaved) && period < 1)) {
+		fprintf(stderr, "ERROR: invalid parameter for %s\n", distribution);
 		return EXIT_FAILURE;
 	}
 
+	key = philox_make_key(seed);
+	/* Rerun with -s <seed> to reproduce this file */
+	fprintf(stderr, "SEED: %llu THREADS: %d\n", (unsigned long long)seed, nthreads);
 
-	
 	fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 	if (fd == -1) {
 		perror("ERROR: open() failed");
 		return EXIT_FAILURE;
 	}
 
-#ifdef DEBUG_MODE	
+	rc = ftruncate(fd, (off_t)n * sizeof(elem));
+	if (rc == -1) {
+		perror("ERROR: ftruncate() failed");
+		return EXIT_FAILURE;
+	}
+
+#ifdef DEBUG_MODE
 	printf("File Descriptor: %d\n", fd);
 #endif
-	ssize_t num_elems;
-	wbuff = (elem *) malloc((BUFF_SZ * sizeof(elem))); 
 
-#ifdef DEBUG_MODE	
-	printf("WRITE:");
-#endif
-	for (int i = 0; i < n; i += BUFF_SZ) {
-		num_elems = min(BUFF_SZ, n - i);	
-		for (int j = 0; j < num_elems; ++j) {
-			wbuff[j] = (*genPtr)();
-			
-#ifdef DEBUG_MODE	
-			printf(" %d,", wbuff[j]);
-#endif
-		}
-		rc = write(fd, wbuff, num_elems * sizeof(elem));
-		if (rc == -1) {
-			perror("ERROR: write() failed");
-			free(wbuff);
+	if (nthreads > n) {
+		nthreads = n > 0 ? (int)n : 1;
+	}
+	pthread_t* threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+	struct gen_task* tasks = (struct gen_task*)calloc(nthreads, sizeof(struct gen_task));
+	if (threads == NULL || tasks == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		return EXIT_FAILURE;
+	}
+
+	for (int t = 0; t < nthreads; ++t) {
+		tasks[t].begin = n / nthreads * t + min(t, n % nthreads);
+		tasks[t].end = tasks[t].begin + n / nthreads + (t < n % nthreads);
+		rc = pthread_create(&threads[t], NULL, gen_range, &tasks[t]);
+		if (rc != 0) {
+			fprintf(stderr, "ERROR: pthread_create() failed: %s\n", strerror(rc));
 			return EXIT_FAILURE;
 		}
 	}
 
-#ifdef DEBUG_MODE	
-	printf("\n");
-#endif
+	int failed = 0;
+	for (int t = 0; t < nthreads; ++t) {
+		pthread_join(threads[t], NULL);
+		failed |= tasks[t].failed;
+	}
+	free(threads);
+	free(tasks);
+	if (failed) {
+		return EXIT_FAILURE;
+	}
+
 	rc = close(fd);
 	if (rc == -1) {
 		perror("ERROR: close() failed");
-		free(wbuff);
 		return EXIT_FAILURE;
 	}
-#ifdef DEBUG_MODE	
-	rc = open(fpath, O_RDONLY);
+#ifdef DEBUG_MODE
+	fd = open(fpath, O_RDONLY);
 	if (fd == -1) {
 		perror("ERROR: open() failed");
-		free(wbuff);
 		return EXIT_FAILURE;
 	}
-	
+
+	elem* rbuff = (elem *) malloc((BUFF_SZ * sizeof(elem)));
 	printf("READ: ");
-	for (int i = 0; i < n; i += BUFF_SZ) {
-		num_elems = min(BUFF_SZ, n - i);
-		rc = read(fd, wbuff, num_elems * sizeof(elem));
+	for (int64_t i = 0; i < n; i += BUFF_SZ) {
+		int64_t num_elems = min(BUFF_SZ, n - i);
+		rc = read(fd, rbuff, num_elems * sizeof(elem));
 		if (rc == -1) {
 			perror("ERROR: read() failed");
-			free(wbuff);
+			free(rbuff);
 			return EXIT_FAILURE;
 		}
-		for (int j = 0; j < num_elems; ++j) {
-			printf(" %d", wbuff[j]);
+		for (int64_t j = 0; j < num_elems; ++j) {
+			printf(" %d", rbuff[j]);
 		}
 	}
 	printf("\n");
+	free(rbuff);
+	close(fd);
 #endif
-	free(wbuff);
 
 	return EXIT_SUCCESS;
 }
-
-
-
-
-
-
-
-
-
-
-
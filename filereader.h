@@ -8,13 +8,20 @@
  * Each rank reads an approximately even number
  * of points. Last rank may have more or less.
  * (tested a bit)
+ * The buffer comes from mem_alloc(), free it
+ * with mem_free().
  *
  *
- * -- write elements to a file in binary form.
- *    (not tested yet)
+ * -- write elements to a file in binary form,
+ *    each rank at its own offset.
+ *
+ * Inputs may also be containers written by index_write()
+ * (index_file.h), then only their keys are read.
  */
 #include <mpi.h>
 #include "serial_sort.h"
+#include "mem_alloc.h"
+#include "index_file.h"
 
 MPI_Offset readfile(int myrank, int numranks, elem** dataptr, char* fname, MPI_Comm fcomm) {
 
@@ -38,9 +45,13 @@ MPI_Offset readfile(int myrank, int numranks, elem** dataptr, char* fname, MPI_C
 		fprintf(stderr, "ERROR rank(%d): MPI_File_get_size() failed with error code (%d): %s", myrank, rc, error_str);
 		exit(EXIT_FAILURE);
 	}		
+	MPI_Offset base;
+	uint32_t flags;
+	index_data_range(fh, fsize, &base, &fsize, &flags);
 	MPI_Offset delta = ( ( ( fsize / sizeof( elem ) ) ) / numranks ) * sizeof ( elem );
 	MPI_Offset offset = delta * myrank;
 	MPI_Offset numrd = myrank + 1 == numranks ? fsize - offset : delta;
+	offset += base;
 
 #ifdef DEBUG_MODE
 	printf("FSIZE     rank(%d): %lld\n", myrank, fsize);
@@ -51,7 +62,7 @@ MPI_Offset readfile(int myrank, int numranks, elem** dataptr, char* fname, MPI_C
 	printf("NUM ELEMS rank(%d): %lld\n", myrank, numrd / sizeof(elem));
 #endif
 
-	*dataptr = (elem *)malloc((size_t)numrd);
+	*dataptr = (elem *)mem_alloc((size_t)numrd);
 	if (dataptr == NULL) {
 		fprintf(stderr, "ERROR rank(%d): malloc() failed.", myrank);
 	}
@@ -73,6 +84,9 @@ MPI_Offset readfile(int myrank, int numranks, elem** dataptr, char* fname, MPI_C
 	return numrd;
 }
 
+/* Largest single MPI-IO call, counts are ints */
+#define FILE_IO_CHUNK (1 << 30)
+
 void writefile(int myrank, int numranks, MPI_Offset startwr, MPI_Offset numwr, const elem* dataptr, char* fname, MPI_Comm fcomm) {
 	
 	char error_str[MPI_MAX_ERROR_STRING];
@@ -80,20 +94,31 @@ void writefile(int myrank, int numranks, MPI_Offset startwr, MPI_Offset numwr, c
 	int rc;
 
 	MPI_File fh;
-	rc = MPI_File_open(fcomm, fname, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+	rc = MPI_File_open(fcomm, fname, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &fh);
 	if (rc != 0) {
 		MPI_Error_string(rc, error_str, &errlen);
 		fprintf(stderr, "ERROR rank(%d): MPI_File_open() failed with error code (%d): %s", myrank, rc, error_str);
 		exit(EXIT_FAILURE);
 	}		
 
-	rc = MPI_File_write_at(fh, startwr, dataptr, numwr, MPI_CHAR, MPI_STATUS_IGNORE);
-	
+	/* Drop whatever an earlier, larger output left behind */
+	rc = MPI_File_set_size(fh, 0);
 	if (rc != 0) {
 		MPI_Error_string(rc, error_str, &errlen);
-		fprintf(stderr, "ERROR rank(%d): MPI_File_write_at() failed with error code (%d): %s", myrank, rc, error_str);
+		fprintf(stderr, "ERROR rank(%d): MPI_File_set_size() failed with error code (%d): %s", myrank, rc, error_str);
 		exit(EXIT_FAILURE);
-	}		
+	}
+
+	for (MPI_Offset done = 0; done < numwr; done += FILE_IO_CHUNK) {
+		int chunk = numwr - done < FILE_IO_CHUNK ? (int)(numwr - done) : FILE_IO_CHUNK;
+		rc = MPI_File_write_at(fh, startwr + done, (const char*)dataptr + done, chunk, MPI_CHAR, MPI_STATUS_IGNORE);
+	
+		if (rc != 0) {
+			MPI_Error_string(rc, error_str, &errlen);
+			fprintf(stderr, "ERROR rank(%d): MPI_File_write_at() failed with error code (%d): %s", myrank, rc, error_str);
+			exit(EXIT_FAILURE);
+		}		
+	}
 	
 	rc = MPI_File_close(&fh);
 	
@@ -104,43 +129,112 @@ void writefile(int myrank, int numranks, MPI_Offset startwr, MPI_Offset numwr, c
 	}	
 }
 
+/* A read started by readfile_begin(), finished by readfile_end().
+ * The buffer is kept across reads and only grows.
+ */
+struct file_prefetch {
+	MPI_File fh;
+	MPI_Request* reqs;
+	int nreqs;
+	elem* buf;
+	MPI_Offset cap;
+	MPI_Offset numrd;
+
+	/* Header flags of the input (index_file.h), 0 for raw keys */
+	uint32_t flags;
+};
+
+void file_prefetch_init(struct file_prefetch* pf) {
+	pf->reqs = NULL;
+	pf->nreqs = 0;
+	pf->buf = NULL;
+	pf->cap = 0;
+	pf->numrd = 0;
+	pf->flags = 0;
+}
 
+void file_prefetch_free(struct file_prefetch* pf) {
+	free(pf->reqs);
+	mem_free(pf->buf);
+	file_prefetch_init(pf);
+}
 
+/* Start reading this rank's share of fname (same split
+ * as readfile()) into pf->buf without waiting for it.
+ */
+void readfile_begin(int myrank, int numranks, struct file_prefetch* pf, char* fname, MPI_Comm fcomm) {
 
+	char error_str[MPI_MAX_ERROR_STRING];
+	int errlen;
+	int rc;
 
+	rc = MPI_File_open(fcomm, fname, MPI_MODE_RDONLY, MPI_INFO_NULL, &pf->fh);
+	if (rc != 0) {
+		MPI_Error_string(rc, error_str, &errlen);
+		fprintf(stderr, "ERROR rank(%d): MPI_File_open() failed with error code (%d): %s", myrank, rc, error_str);
+		exit(EXIT_FAILURE);
+	}		
 
+	MPI_Offset fsize;
+	rc = MPI_File_get_size(pf->fh, &fsize);
+	
+	if (rc != 0) {
+		MPI_Error_string(rc, error_str, &errlen);
+		fprintf(stderr, "ERROR rank(%d): MPI_File_get_size() failed with error code (%d): %s", myrank, rc, error_str);
+		exit(EXIT_FAILURE);
+	}		
+	MPI_Offset base;
+	index_data_range(pf->fh, fsize, &base, &fsize, &pf->flags);
+	MPI_Offset delta = ( ( ( fsize / sizeof( elem ) ) ) / numranks ) * sizeof ( elem );
+	MPI_Offset offset = base + delta * myrank;
+	pf->numrd = myrank + 1 == numranks ? fsize - delta * myrank : delta;
+
+	if (pf->buf == NULL || pf->numrd > pf->cap) {
+		mem_free(pf->buf);
+		pf->buf = (elem *)mem_alloc((size_t)pf->numrd);
+		if (pf->buf == NULL) {
+			fprintf(stderr, "ERROR rank(%d): malloc() failed.", myrank);
+			exit(EXIT_FAILURE);
+		}
+		pf->cap = pf->numrd;
+	}
 
+	free(pf->reqs);
+	pf->nreqs = (int)((pf->numrd + FILE_IO_CHUNK - 1) / FILE_IO_CHUNK);
+	pf->reqs = (MPI_Request*)malloc((pf->nreqs + 1) * sizeof(MPI_Request));
+
+	for (int i = 0; i < pf->nreqs; ++i) {
+		MPI_Offset done = (MPI_Offset)i * FILE_IO_CHUNK;
+		int chunk = pf->numrd - done < FILE_IO_CHUNK ? (int)(pf->numrd - done) : FILE_IO_CHUNK;
+		rc = MPI_File_iread_at(pf->fh, offset + done, (char*)pf->buf + done, chunk, MPI_CHAR, &pf->reqs[i]);
+		if (rc != 0) {
+			MPI_Error_string(rc, error_str, &errlen);
+			fprintf(stderr, "ERROR rank(%d): MPI_File_iread_at(numrd: %lld) failed with error code (%d): %s", myrank, pf->numrd, rc, error_str);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
 
+/* Wait for the read started by readfile_begin(), returns the bytes read */
+MPI_Offset readfile_end(int myrank, struct file_prefetch* pf) {
 
+	char error_str[MPI_MAX_ERROR_STRING];
+	int errlen;
+	int rc;
 
+	rc = MPI_Waitall(pf->nreqs, pf->reqs, MPI_STATUSES_IGNORE);
+	if (rc != 0) {
+		MPI_Error_string(rc, error_str, &errlen);
+		fprintf(stderr, "ERROR rank(%d): MPI_Waitall(iread) failed with error code (%d): %s", myrank, rc, error_str);
+		exit(EXIT_FAILURE);
+	}
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+	rc = MPI_File_close(&pf->fh);
+	
+	if (rc != 0) {
+		MPI_Error_string(rc, error_str, &errlen);
+		fprintf(stderr, "ERROR rank(%d): MPI_File_close() failed with error code (%d): %s", myrank, rc, error_str);
+		exit(EXIT_FAILURE);
+	}
+	return pf->numrd;
+}
@@ -0,0 +1,151 @@
+/* Distributed selection without sorting.
+ *
+ *   elem v = hq_select(&ctx, data, n, k);    (kth smallest of all ranks, from 1)
+ *   hq_top_k(&ctx, data, n, k, out);         (k largest on rank 0)
+ *
+ * hq_select() is a quickselect over all ranks: every
+ * round picks the pivot of a hypercube level (median
+ * of the ranks' local medians, hq_consensus_median()),
+ * splits each rank's remaining window in place into
+ * keys below, equal to and above it, and adds up only
+ * the counts. The window shrinks to the side holding
+ * the kth key until the pivot is it. Expected O(n)
+ * local work and O(log N) rounds of small collectives.
+ *
+ * Both reorder data but leave it a permutation of the
+ * input, so any number of queries can run on it.
+ */
+
+#ifndef HQ_SELECT_H
+#define HQ_SELECT_H
+
+#include <mpi.h>
+#include <stdint.h>
+#include <limits.h>
+#include "hyperquicksort.h"
+
+/* Number of keys over all ranks */
+uint64_t hq_count(struct hq_context* ctx, size_t n) {
+	uint64_t own = n;
+	uint64_t total;
+	int rc = MPI_Allreduce(&own, &total, 1, MPI_UINT64_T, MPI_SUM, ctx->comm);
+	hq_check(rc, "MPI_Allreduce(count)", ctx->rank);
+	return total;
+}
+
+/* kth smallest key over all ranks of ctx, 1 <= k <= total
+ * keys. The number of rounds is stored in rounds if not NULL.
+ */
+elem hq_select(struct hq_context* ctx, elem* data, size_t n, uint64_t k, int* rounds) {
+	int rc;
+	elem* l = data;
+	size_t m = n;
+	int round = 0;
+
+	for (;; ++round) {
+		elem pv = hq_consensus_median(ctx, ctx->comm, ctx->rank, ctx->numranks, l, m);
+
+		/* [l, lt) < pv, [lt, le) == pv, [le, l + m) > pv */
+		elem* le = m > 0 ? ctx->backend->partition(l, l + m - 1, pv) : l;
+		elem* lt = (pv > INT_MIN && le > l) ? ctx->backend->partition(l, le - 1, pv - 1) : l;
+
+		uint64_t own[2] = { (uint64_t)(lt - l), (uint64_t)(le - lt) };
+		uint64_t cnt[2];
+		rc = MPI_Allreduce(own, cnt, 2, MPI_UINT64_T, MPI_SUM, ctx->comm);
+		hq_check(rc, "MPI_Allreduce(select counts)", ctx->rank);
+
+		if (k <= cnt[0]) {
+			m = lt - l;
+		} else if (k <= cnt[0] + cnt[1]) {
+			if (rounds != NULL) {
+				*rounds = round + 1;
+			}
+			return pv;
+		} else {
+			k -= cnt[0] + cnt[1];
+			m = l + m - le;
+			l = le;
+		}
+	}
+}
+
+/* The k largest keys over all ranks of ctx (k <= total
+ * keys and INT_MAX) in descending order into out on
+ * rank 0, which must have room for k. Ties at the
+ * smallest of them are taken from the lowest ranks.
+ */
+void hq_top_k(struct hq_context* ctx, elem* data, size_t n, uint64_t k, elem* out) {
+	int rc;
+	if (k == 0) {
+		return;
+	}
+	uint64_t total = hq_count(ctx, n);
+	elem t = hq_select(ctx, data, n, total - k + 1, NULL);
+
+	/* Keys above t, then as many copies of t as are still missing */
+	uint64_t own[2] = { 0, 0 };
+	for (size_t i = 0; i < n; ++i) {
+		own[0] += (data[i] > t);
+		own[1] += (data[i] == t);
+	}
+	uint64_t above;
+	rc = MPI_Allreduce(&own[0], &above, 1, MPI_UINT64_T, MPI_SUM, ctx->comm);
+	hq_check(rc, "MPI_Allreduce(above)", ctx->rank);
+	uint64_t equal_before = 0;
+	rc = MPI_Exscan(&own[1], &equal_before, 1, MPI_UINT64_T, MPI_SUM, ctx->comm);
+	hq_check(rc, "MPI_Exscan(equal)", ctx->rank);
+	if (ctx->rank == 0) {
+		equal_before = 0;
+	}
+	uint64_t need = k - above;
+	uint64_t take = need > equal_before ? need - equal_before : 0;
+	take = take < own[1] ? take : own[1];
+
+	int own_n = (int)(own[0] + take);
+	elem* mine = (elem*)malloc((own_n + 1) * sizeof(elem));
+	if (mine == NULL) {
+		fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	int put = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (data[i] > t) {
+			mine[put++] = data[i];
+		} else if (data[i] == t && take > 0) {
+			mine[put++] = data[i];
+			--take;
+		}
+	}
+
+	int* counts = NULL;
+	int* displs = NULL;
+	if (ctx->rank == 0) {
+		counts = (int*)calloc(ctx->numranks, sizeof(int));
+		displs = (int*)calloc(ctx->numranks, sizeof(int));
+		if (counts == NULL || displs == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): calloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+	}
+	rc = MPI_Gather(&own_n, 1, MPI_INT, counts, 1, MPI_INT, 0, ctx->comm);
+	hq_check(rc, "MPI_Gather(top counts)", ctx->rank);
+	if (ctx->rank == 0) {
+		for (int i = 1; i < ctx->numranks; ++i) {
+			displs[i] = displs[i - 1] + counts[i - 1];
+		}
+	}
+	rc = MPI_Gatherv(mine, own_n, MPI_INT32_T, out, counts, displs, MPI_INT32_T, 0, ctx->comm);
+	hq_check(rc, "MPI_Gatherv(top)", ctx->rank);
+	free(mine);
+	free(counts);
+	free(displs);
+
+	if (ctx->rank == 0) {
+		ctx->backend->sort(out, out + k - 1);
+		for (uint64_t i = 0; i < k / 2; ++i) {
+			swap(&out[i], &out[k - 1 - i]);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,1026 @@
+/* Hypercube quicksort as a reentrant library call.
+ *
+ * Sorts a distributed array already held by the
+ * ranks of a communicator:
+ *
+ *   struct hq_context ctx;
+ *   hq_init(&ctx, comm);
+ *   hq_sort(&ctx, data, n, &res);   (any number of times)
+ *   ... res.data[0, res.n) is sorted, at global offset res.offset
+ *   hq_finalize(&ctx);
+ *
+ * The number of ranks in comm must be a power of 2.
+ * hq_init() duplicates comm and builds the communicator
+ * of every hypercube level once, so repeated sorts
+ * reuse them and hq_finalize() frees all of them.
+ * The exchange buffers also live in the context and
+ * only grow, so a sequence of sorts allocates once.
+ * They come from mem_alloc() and follow the huge page
+ * and NUMA policy set with mem_policy_init().
+ *
+ * hq_enable_shm() switches the context to node-aware
+ * exchanges: the exchange buffers move into MPI shared
+ * memory windows of the ranks on the same node, and a
+ * level whose partner is on the same node copies the
+ * partner's half straight out of the partner's buffer
+ * instead of sending a message. Partners on other
+ * nodes still exchange pairwise over MPI.
+ *
+ * hq_enable_compress() bit-packs the halves exchanged
+ * over MPI (see codec.h). In auto mode a rank packs its
+ * half only when the predicted encode + decode time plus
+ * the packed transfer beats sending it raw, using the
+ * codec speed and link bandwidth measured when enabled.
+ *
+ * hq_sort() uses data as scratch space (its contents are
+ * reordered) but does not free it. The sorted range in
+ * the result lives in the context's buffers (or in data
+ * on a single rank or after a presort fast path) and
+ * stays valid until the next hq_sort() or hq_finalize()
+ * on the context.
+ *
+ * With ctx->presort set, hq_sort() first checks how
+ * sorted the input already is (see presort.h) and
+ * leaves it in place, or only fixes up the order
+ * between neighbouring ranks, when that is enough.
+ *
+ * The local median, split and final sort are done by
+ * ctx->backend (see sort_backend.h), which can be
+ * changed between sorts.
+ *
+ * Compile with -D DEBUG_MODE for debug output.
+ */
+
+#ifndef HYPERQUICKSORT_H
+#define HYPERQUICKSORT_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include "serial_sort.h"
+#include "codec.h"
+#include "mem_alloc.h"
+#include "sort_backend.h"
+#include "presort.h"
+
+/* Algorithms of hq_sort(), HQ_ALGO_AUTO picks one with the cost model */
+#define HQ_ALGO_HYPERCUBE  0
+#define HQ_ALGO_GATHER     1
+#define HQ_ALGO_SAMPLESORT 2
+#define HQ_NUM_ALGOS       3
+#define HQ_ALGO_AUTO       HQ_NUM_ALGOS
+
+const char* hq_algo_names[HQ_NUM_ALGOS + 1] = { "hypercube", "gather", "samplesort", "auto" };
+
+/* Communicators of one sorting group, reused across sorts */
+struct hq_context {
+	/* Duplicate of the caller's communicator */
+	MPI_Comm comm;
+
+	/* Own rank, total number of ranks in comm */
+	int rank;
+	int numranks;
+
+	/* log2(numranks) */
+	int levels;
+
+	/* level_comms[i] holds the numranks >> i ranks
+	 * sharing this rank's half at level i,
+	 * level_comms[0] is comm itself.
+	 */
+	MPI_Comm* level_comms;
+
+	/* Exchange buffers, levels alternate between them */
+	elem* buf[2];
+	size_t buf_cap[2];
+
+	/* Node-aware exchanges through shared memory (hq_enable_shm) */
+	int shm;
+
+	/* Ranks of comm on this node */
+	MPI_Comm node_comm;
+
+	/* Rank in node_comm of each level's partner, MPI_UNDEFINED off node */
+	int* level_partner;
+
+	/* Windows holding buf[0], buf[1] and every rank's hq_shm_header */
+	MPI_Win buf_win[2];
+	MPI_Win hdr_win;
+	struct hq_shm_header* hdr;
+
+	/* Packing of MPI exchanges (hq_enable_compress), one of HQ_COMPRESS_* */
+	int compress;
+
+	/* Link to the first level's partner, from hq_probe_link() */
+	double link_latency;   /* seconds */
+	double link_bandwidth; /* bytes per second */
+
+	/* Encode plus decode time per key */
+	double codec_sec_per_key;
+
+	/* Packed outgoing and incoming halves */
+	unsigned char* codec_buf[2];
+	size_t codec_cap[2];
+
+	/* Bytes of keys handed to hq_exchange(), and bytes actually sent */
+	uint64_t bytes_raw;
+	uint64_t bytes_wire;
+
+	/* Serial kernels run on the local data */
+	const struct sort_backend* backend;
+
+	/* Try the presort fast paths first, and what they did last time */
+	int presort;
+	struct presort_stats presort_stats;
+
+	/* Algorithm hq_sort() runs, one of HQ_ALGO_*, and the one it picked last time */
+	int algorithm;
+	int last_algorithm;
+
+	/* Final local sort time per key and log2(keys), from hq_calibrate() */
+	double sort_sec_per_key;
+
+	/* Predicted seconds of each algorithm for the last sort (HQ_ALGO_AUTO) */
+	double predicted[HQ_NUM_ALGOS];
+};
+
+#define HQ_COMPRESS_OFF  0
+#define HQ_COMPRESS_ON   1
+#define HQ_COMPRESS_AUTO 2
+
+/* Blocks sampled to predict the packed size of a half */
+#define HQ_COMPRESS_SAMPLES 16
+
+/* What a rank offers its node-local partner at a level */
+struct hq_shm_header {
+	/* Which exchange buffer and where in it the partner's half starts */
+	uint64_t buf;
+	uint64_t offset;
+	uint64_t size;
+};
+
+/* Sorted range held by this rank after hq_sort() */
+struct hq_result {
+	elem* data;
+	size_t n;
+
+	/* Global offset of data[0] in the sorted array */
+	size_t offset;
+};
+
+/* Number of bits in a 32 bit integer
+ * If bitCount(n) = 1, then n is a power of 2
+ */
+int bitCount(int num) {
+	__int32_t bit = 1;
+	int ans = 0;
+	for (int i = 0; i < sizeof(num) * 8; ++i, bit <<= 1) {
+		ans += ((bit & num) != 0);
+	}
+	return ans;
+}
+
+/* Abort with the MPI error string if rc is not MPI_SUCCESS */
+void hq_check(int rc, const char* what, int rank) {
+	if (rc != MPI_SUCCESS) {
+		char errorStr[MPI_MAX_ERROR_STRING];
+		int errorlen;
+		MPI_Error_string(rc, errorStr, &errorlen);
+		fprintf(stderr, "ERROR RANK(%d): %s failed with error code(%d): %s\n", rank, what, rc, errorStr);
+		MPI_Abort(MPI_COMM_WORLD, rc);
+	}
+}
+
+/* Returns MPI_ERR_SIZE if comm's size is not a power of 2 */
+int hq_init(struct hq_context* ctx, MPI_Comm comm) {
+	int rc;
+	MPI_Comm_rank(comm, &ctx->rank);
+	MPI_Comm_size(comm, &ctx->numranks);
+	ctx->level_comms = NULL;
+	ctx->comm = MPI_COMM_NULL;
+	ctx->buf[0] = ctx->buf[1] = NULL;
+	ctx->buf_cap[0] = ctx->buf_cap[1] = 0;
+	ctx->shm = 0;
+	ctx->compress = HQ_COMPRESS_OFF;
+	ctx->link_latency = 0;
+	ctx->link_bandwidth = 0;
+	ctx->codec_sec_per_key = 0;
+	ctx->codec_buf[0] = ctx->codec_buf[1] = NULL;
+	ctx->codec_cap[0] = ctx->codec_cap[1] = 0;
+	ctx->bytes_raw = 0;
+	ctx->bytes_wire = 0;
+	ctx->backend = SORT_BACKEND_DEFAULT;
+	ctx->presort = 0;
+	ctx->presort_stats.path = PRESORT_NONE;
+	ctx->algorithm = HQ_ALGO_HYPERCUBE;
+	ctx->last_algorithm = HQ_ALGO_HYPERCUBE;
+	ctx->sort_sec_per_key = 0;
+	for (int i = 0; i < HQ_NUM_ALGOS; ++i) {
+		ctx->predicted[i] = 0;
+	}
+
+	if (bitCount(ctx->numranks) != 1) {
+		return MPI_ERR_SIZE;
+	}
+
+	ctx->levels = 0;
+	while ((1 << ctx->levels) < ctx->numranks) {
+		++ctx->levels;
+	}
+
+	rc = MPI_Comm_dup(comm, &ctx->comm);
+	hq_check(rc, "MPI_Comm_dup()", ctx->rank);
+
+	ctx->level_comms = (MPI_Comm*)calloc(ctx->levels + 1, sizeof(MPI_Comm));
+	if (ctx->level_comms == NULL) {
+		fprintf(stderr, "ERROR RANK(%d): calloc() failed\n", ctx->rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	ctx->level_comms[0] = ctx->comm;
+
+	for (int level = 0; level < ctx->levels; ++level) {
+		int localNumranks = ctx->numranks >> level;
+		int localRank = ctx->rank % localNumranks;
+		const int color = (localRank >= (localNumranks >> 1));
+		const int key   = (localRank % (localNumranks >> 1));
+		rc = MPI_Comm_split(ctx->level_comms[level], color, key, &ctx->level_comms[level + 1]);
+		hq_check(rc, "MPI_Comm_split()", ctx->rank);
+	}
+	return MPI_SUCCESS;
+}
+
+void hq_finalize(struct hq_context* ctx) {
+	if (ctx->level_comms == NULL) {
+		return;
+	}
+	for (int level = 0; level <= ctx->levels; ++level) {
+		MPI_Comm_free(&ctx->level_comms[level]);
+	}
+	free(ctx->level_comms);
+	ctx->level_comms = NULL;
+	ctx->comm = MPI_COMM_NULL;
+	for (int i = 0; i < 2; ++i) {
+		if (ctx->shm) {
+			MPI_Win_unlock_all(ctx->buf_win[i]);
+			MPI_Win_free(&ctx->buf_win[i]);
+		} else {
+			mem_free(ctx->buf[i]);
+		}
+		ctx->buf[i] = NULL;
+		ctx->buf_cap[i] = 0;
+	}
+	for (int i = 0; i < 2; ++i) {
+		mem_free(ctx->codec_buf[i]);
+		ctx->codec_buf[i] = NULL;
+		ctx->codec_cap[i] = 0;
+	}
+	if (ctx->shm) {
+		MPI_Win_unlock_all(ctx->hdr_win);
+		MPI_Win_free(&ctx->hdr_win);
+		MPI_Comm_free(&ctx->node_comm);
+		free(ctx->level_partner);
+		ctx->shm = 0;
+	}
+}
+
+/* (Re)allocate shared exchange buffer i with cap elements on this rank */
+void hq_shm_alloc(struct hq_context* ctx, int i, size_t cap) {
+	int rc;
+	MPI_Info info;
+	MPI_Info_create(&info);
+	/* Let every rank's segment be placed on its own NUMA node */
+	MPI_Info_set(info, "alloc_shared_noncontig", "true");
+	/* One spare element keeps the base of an empty segment a valid pointer */
+	rc = MPI_Win_allocate_shared((MPI_Aint)((cap + 1) * sizeof(elem)), sizeof(elem), info, ctx->node_comm,
+			&ctx->buf[i], &ctx->buf_win[i]);
+	hq_check(rc, "MPI_Win_allocate_shared(buf)", ctx->rank);
+	MPI_Info_free(&info);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, ctx->buf_win[i]);
+	ctx->buf_cap[i] = cap;
+}
+
+/* Collective over comm: find the ranks sharing this
+ * node and move the exchange buffers into shared memory.
+ * Returns the number of levels whose partner is on
+ * this node.
+ */
+int hq_enable_shm(struct hq_context* ctx) {
+	int rc;
+	if (ctx->shm) {
+		return 0;
+	}
+	for (int i = 0; i < 2; ++i) {
+		mem_free(ctx->buf[i]);
+	}
+
+	rc = MPI_Comm_split_type(ctx->comm, MPI_COMM_TYPE_SHARED, ctx->rank, MPI_INFO_NULL, &ctx->node_comm);
+	hq_check(rc, "MPI_Comm_split_type()", ctx->rank);
+
+	MPI_Group group;
+	MPI_Group node_group;
+	MPI_Comm_group(ctx->comm, &group);
+	MPI_Comm_group(ctx->node_comm, &node_group);
+
+	int intra = 0;
+	ctx->level_partner = (int*)malloc((ctx->levels + 1) * sizeof(int));
+	for (int level = 0; level < ctx->levels; ++level) {
+		int half = (ctx->numranks >> level) >> 1;
+		int localRank = ctx->rank % (ctx->numranks >> level);
+		int partner = localRank >= half ? ctx->rank - half : ctx->rank + half;
+		MPI_Group_translate_ranks(group, 1, &partner, node_group, &ctx->level_partner[level]);
+		intra += (ctx->level_partner[level] != MPI_UNDEFINED);
+	}
+	MPI_Group_free(&group);
+	MPI_Group_free(&node_group);
+
+	rc = MPI_Win_allocate_shared((MPI_Aint)sizeof(struct hq_shm_header), 1, MPI_INFO_NULL, ctx->node_comm,
+			&ctx->hdr, &ctx->hdr_win);
+	hq_check(rc, "MPI_Win_allocate_shared(hdr)", ctx->rank);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, ctx->hdr_win);
+
+	for (int i = 0; i < 2; ++i) {
+		hq_shm_alloc(ctx, i, 0);
+	}
+	ctx->shm = 1;
+	return intra;
+}
+
+/* Exchange buffer i with room for at least n elements.
+ * Collective over the node with shared buffers, whose
+ * windows can only be reallocated together.
+ */
+elem* hq_buffer(struct hq_context* ctx, int i, size_t n) {
+	if (ctx->shm) {
+		int grow = (n > ctx->buf_cap[i]);
+		int any_grow;
+		hq_check(MPI_Allreduce(&grow, &any_grow, 1, MPI_INT, MPI_LOR, ctx->node_comm), "MPI_Allreduce(grow)", ctx->rank);
+		if (any_grow) {
+			size_t cap = ctx->buf_cap[i] + ctx->buf_cap[i] / 2;
+			cap = cap > n ? cap : n;
+			MPI_Win_unlock_all(ctx->buf_win[i]);
+			MPI_Win_free(&ctx->buf_win[i]);
+			hq_shm_alloc(ctx, i, grow ? cap : ctx->buf_cap[i]);
+		}
+		return ctx->buf[i];
+	}
+	if (ctx->buf[i] == NULL || n > ctx->buf_cap[i]) {
+		/* Grow geometrically so slowly growing inputs settle quickly */
+		size_t cap = ctx->buf_cap[i] + ctx->buf_cap[i] / 2;
+		cap = cap > n ? cap : n;
+		mem_free(ctx->buf[i]);
+		ctx->buf[i] = (elem*)mem_alloc(cap * sizeof(elem));
+		if (ctx->buf[i] == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		ctx->buf_cap[i] = cap;
+	}
+	return ctx->buf[i];
+}
+
+/* Pick the pivot of a level: the median of the
+ * medians of the ranks that still hold elements.
+ */
+elem hq_consensus_median(struct hq_context* ctx, MPI_Comm comm, int localRank, int localNumranks, elem* data, size_t n) {
+	int rc;
+	int* localHaveElems = NULL;
+	elem* localMedians = NULL;
+
+	int ownHasElems = (n > 0);
+	elem ownLocalMedian = 0;
+	if (ownHasElems) {
+		ownLocalMedian = ctx->backend->select(data, data + n - 1, n/2);
+	}
+
+	if (localRank == 0) { /* LEADER */
+		localHaveElems = (int*)calloc(localNumranks, sizeof(int));
+		localMedians = (elem*)calloc(localNumranks, sizeof(elem));
+	}
+
+	rc = MPI_Gather(&ownHasElems, 1, MPI_INT32_T, localHaveElems, 1, MPI_INT32_T, 0, comm);
+	hq_check(rc, "MPI_Gather(HasElems)", ctx->rank);
+
+	rc = MPI_Gather(&ownLocalMedian, 1, MPI_INT32_T, localMedians, 1, MPI_INT32_T, 0, comm);
+	hq_check(rc, "MPI_Gather(localMedians)", ctx->rank);
+
+	elem consensusMedian = 0;
+	if (localRank == 0) {
+		/* Move all medians to the beginning of the array */
+		int medianEnd = localNumranks;
+		int medianStart = 0;
+		for (; medianStart < medianEnd; medianStart += (localHaveElems[medianStart] > 0)) {
+			if (localHaveElems[medianStart] == 0) {
+				--medianEnd;
+				swap(&localHaveElems[medianEnd], &localHaveElems[medianStart]);
+				swap(&localMedians[medianEnd], &localMedians[medianStart]);
+			}
+		}
+
+		if (medianEnd > 0) {
+			consensusMedian = findKth(localMedians, localMedians + medianEnd - 1, medianEnd/2);
+		}
+
+		free(localMedians);
+		free(localHaveElems);
+	}
+
+	rc = MPI_Bcast(&consensusMedian, 1, MPI_INT32_T, 0, comm);
+	hq_check(rc, "MPI_Bcast(consensusMedian)", ctx->rank);
+
+#ifdef DEBUG_MODE
+	fprintf(stderr, "G_RANK(%d) L_RANK(%d) CONSENSUS_MEDIAN(%d)\n", ctx->rank, localRank, consensusMedian);
+#endif
+	return consensusMedian;
+}
+
+/* Measure latency and bandwidth to the first level's
+ * partner with a ping-pong, best of a few rounds.
+ * Collective over comm.
+ */
+void hq_probe_link(struct hq_context* ctx) {
+	const int tag = 124;
+	const int rounds = 5;
+	const int big = 1 << 20;
+	if (ctx->levels == 0) {
+		return;
+	}
+	int half = ctx->numranks >> 1;
+	int partner = ctx->rank >= half ? ctx->rank - half : ctx->rank + half;
+	char* msg = (char*)calloc(big, 1);
+	double best_small = 1e30;
+	double best_big = 1e30;
+
+	for (int r = 0; r < rounds; ++r) {
+		for (int sz = 1; sz <= big; sz = (sz == 1 ? big : sz + 1)) {
+			MPI_Barrier(ctx->comm);
+			double t = MPI_Wtime();
+			if (ctx->rank < half) {
+				MPI_Send(msg, sz, MPI_BYTE, partner, tag, ctx->comm);
+				MPI_Recv(msg, sz, MPI_BYTE, partner, tag, ctx->comm, MPI_STATUS_IGNORE);
+			} else {
+				MPI_Recv(msg, sz, MPI_BYTE, partner, tag, ctx->comm, MPI_STATUS_IGNORE);
+				MPI_Send(msg, sz, MPI_BYTE, partner, tag, ctx->comm);
+			}
+			t = (MPI_Wtime() - t) / 2;
+			if (sz == 1) {
+				best_small = t < best_small ? t : best_small;
+			} else {
+				best_big = t < best_big ? t : best_big;
+			}
+		}
+	}
+	free(msg);
+
+	/* Every rank uses the slowest pair's numbers */
+	double lat = best_small;
+	double per_byte = (best_big - best_small) / big;
+	MPI_Allreduce(&lat, &ctx->link_latency, 1, MPI_DOUBLE, MPI_MAX, ctx->comm);
+	MPI_Allreduce(MPI_IN_PLACE, &per_byte, 1, MPI_DOUBLE, MPI_MAX, ctx->comm);
+	ctx->link_bandwidth = per_byte > 0 ? 1 / per_byte : 1e30;
+}
+
+/* Turn on packing of the halves exchanged over MPI,
+ * mode is one of HQ_COMPRESS_*. Collective over comm.
+ */
+void hq_enable_compress(struct hq_context* ctx, int mode) {
+	ctx->compress = mode;
+	if (mode != HQ_COMPRESS_AUTO) {
+		return;
+	}
+	hq_probe_link(ctx);
+
+	/* Codec speed on keys spread over 16 bits */
+	const size_t n = 1 << 16;
+	elem* keys = (elem*)malloc(n * sizeof(elem));
+	unsigned char* packed = (unsigned char*)malloc(codec_bound(n));
+	for (size_t i = 0; i < n; ++i) {
+		keys[i] = (elem)((i * 2654435761u) & 0xFFFF);
+	}
+	double best = 1e30;
+	for (int r = 0; r < 3; ++r) {
+		double t = MPI_Wtime();
+		codec_encode(keys, n, packed);
+		codec_decode(packed, n, keys);
+		t = MPI_Wtime() - t;
+		best = t < best ? t : best;
+	}
+	ctx->codec_sec_per_key = best / n;
+	free(keys);
+	free(packed);
+}
+
+/* Codec buffer i with room for at least bytes */
+unsigned char* hq_codec_buffer(struct hq_context* ctx, int i, size_t bytes) {
+	if (bytes > ctx->codec_cap[i]) {
+		mem_free(ctx->codec_buf[i]);
+		ctx->codec_buf[i] = (unsigned char*)mem_alloc(bytes);
+		if (ctx->codec_buf[i] == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		ctx->codec_cap[i] = bytes;
+	}
+	return ctx->codec_buf[i];
+}
+
+/* Pack send_arr into codec buffer 0 if that is expected
+ * to pay off, returns the packed size or 0 to send raw
+ */
+size_t hq_maybe_compress(struct hq_context* ctx, const elem* send_arr, size_t send_size) {
+	if (ctx->compress == HQ_COMPRESS_OFF || send_size == 0) {
+		return 0;
+	}
+	if (ctx->compress == HQ_COMPRESS_AUTO) {
+		double ratio = codec_estimate_ratio(send_arr, send_size, HQ_COMPRESS_SAMPLES);
+		double raw_bytes = (double)send_size * sizeof(elem);
+		double t_raw = raw_bytes / ctx->link_bandwidth;
+		double t_packed = send_size * ctx->codec_sec_per_key + ratio * raw_bytes / ctx->link_bandwidth;
+		if (t_packed >= t_raw) {
+			return 0;
+		}
+	}
+	unsigned char* packed = hq_codec_buffer(ctx, 0, codec_bound(send_size));
+	size_t bytes = codec_encode(send_arr, send_size, packed);
+	if (bytes >= send_size * sizeof(elem) || bytes > INT_MAX) {
+		return 0;
+	}
+	return bytes;
+}
+
+/* Swap element counts and packed sizes (0 when raw) with the partner of the level */
+size_t hq_exchange_size(struct hq_context* ctx, MPI_Comm comm, int src_rank, size_t send_size, size_t send_bytes,
+		size_t* recv_bytes) {
+	const int tag = 123;
+	int rc;
+	uint64_t send_hdr[2] = { send_size, send_bytes };
+	uint64_t recv_hdr[2];
+	MPI_Request request_send = MPI_REQUEST_NULL;
+	MPI_Request request_recv = MPI_REQUEST_NULL;
+
+	rc = MPI_Irecv(recv_hdr, 2, MPI_UINT64_T, src_rank, tag, comm, &request_recv);
+	hq_check(rc, "MPI_Irecv(recv_size)", ctx->rank);
+	rc = MPI_Isend(send_hdr, 2, MPI_UINT64_T, src_rank, tag, comm, &request_send);
+	hq_check(rc, "MPI_Isend(send_size)", ctx->rank);
+
+	MPI_Wait(&request_send, MPI_STATUS_IGNORE);
+	MPI_Wait(&request_recv, MPI_STATUS_IGNORE);
+	*recv_bytes = recv_hdr[1];
+	return recv_hdr[0];
+}
+
+/* Send send_arr to the partner of the level while
+ * receiving its recv_size elements into recv_arr.
+ * A non-zero send_bytes/recv_bytes means that half
+ * travels packed (send_bytes of codec buffer 0).
+ */
+void hq_exchange(struct hq_context* ctx, MPI_Comm comm, int src_rank, const elem* send_arr, size_t send_size,
+		size_t send_bytes, elem* recv_arr, size_t recv_size, size_t recv_bytes) {
+	const int tag = 123;
+	int rc;
+	MPI_Request request_send = MPI_REQUEST_NULL;
+	MPI_Request request_recv = MPI_REQUEST_NULL;
+
+	unsigned char* packed = NULL;
+	if (recv_bytes > 0) {
+		packed = hq_codec_buffer(ctx, 1, codec_bound(recv_size));
+		rc = MPI_Irecv(packed, recv_bytes, MPI_BYTE, src_rank, tag, comm, &request_recv);
+	} else {
+		rc = MPI_Irecv(recv_arr, recv_size, MPI_INT32_T, src_rank, tag, comm, &request_recv);
+	}
+	hq_check(rc, "MPI_Irecv(recv_arr)", ctx->rank);
+	if (send_bytes > 0) {
+		rc = MPI_Isend(ctx->codec_buf[0], send_bytes, MPI_BYTE, src_rank, tag, comm, &request_send);
+	} else {
+		rc = MPI_Isend(send_arr, send_size, MPI_INT32_T, src_rank, tag, comm, &request_send);
+	}
+	hq_check(rc, "MPI_Isend(send_arr)", ctx->rank);
+
+	MPI_Wait(&request_send, MPI_STATUS_IGNORE);
+	MPI_Wait(&request_recv, MPI_STATUS_IGNORE);
+
+	if (recv_bytes > 0) {
+		codec_decode(packed, recv_size, recv_arr);
+	}
+	ctx->bytes_raw += send_size * sizeof(elem);
+	ctx->bytes_wire += send_bytes > 0 ? send_bytes : send_size * sizeof(elem);
+}
+
+/* Publish this rank's outgoing half of a level to the
+ * node and wait for the whole node to do the same.
+ * If the level's partner is on this node, returns 1 and
+ * sets *recv_arr to its outgoing half in shared memory
+ * and *recv_size, otherwise returns 0. *recv_arr may be
+ * NULL when the half is empty. Collective over the node.
+ */
+int hq_shm_offer(struct hq_context* ctx, int level, elem* send_arr, size_t send_size, const elem** recv_arr,
+		size_t* recv_size) {
+	int partner = ctx->level_partner[level];
+
+	/* The first level's elements are in the caller's memory,
+	 * stage the outgoing half in the buffer the level does not fill.
+	 */
+	int from = (level + 1) % 2;
+	elem* staged = hq_buffer(ctx, from, level == 0 && partner != MPI_UNDEFINED ? send_size : 0);
+	if (level == 0 && partner != MPI_UNDEFINED) {
+		memcpy(staged, send_arr, send_size * sizeof(elem));
+		send_arr = staged;
+	}
+
+	ctx->hdr->buf = from;
+	ctx->hdr->offset = send_arr - ctx->buf[from];
+	ctx->hdr->size = send_size;
+
+	MPI_Win_sync(ctx->hdr_win);
+	MPI_Win_sync(ctx->buf_win[from]);
+	hq_check(MPI_Barrier(ctx->node_comm), "MPI_Barrier(node)", ctx->rank);
+	MPI_Win_sync(ctx->hdr_win);
+	MPI_Win_sync(ctx->buf_win[from]);
+
+	if (partner == MPI_UNDEFINED) {
+		return 0;
+	}
+
+	MPI_Aint sz;
+	int disp;
+	struct hq_shm_header* phdr;
+	elem* pbuf;
+	MPI_Win_shared_query(ctx->hdr_win, partner, &sz, &disp, &phdr);
+	MPI_Win_shared_query(ctx->buf_win[phdr->buf], partner, &sz, &disp, &pbuf);
+	*recv_size = phdr->size;
+	*recv_arr = phdr->size > 0 ? pbuf + phdr->offset : NULL;
+	return 1;
+}
+
+/* Global offset of this rank's n sorted elements, from
+ * the prefix sums of every rank's size gathered on rank 0
+ */
+size_t hq_offset(struct hq_context* ctx, size_t n) {
+	int rc;
+	size_t* fsums = NULL;
+
+	if (ctx->rank == 0) {
+		fsums = (size_t*)calloc(ctx->numranks + 1, sizeof(size_t));
+		if (fsums == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): calloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+	}
+
+	rc = MPI_Gather(&n, 1, MPI_UINT64_T, ctx->rank == 0 ? fsums + 1 : NULL, 1, MPI_UINT64_T, 0, ctx->comm);
+	hq_check(rc, "MPI_Gather(fsums)", ctx->rank);
+
+	if (ctx->rank == 0) {
+		for (int i = 1; i <= ctx->numranks; ++i) {
+			fsums[i] += fsums[i - 1];
+		}
+	}
+
+	size_t offset;
+	rc = MPI_Scatter(fsums, 1, MPI_UINT64_T, &offset, 1, MPI_UINT64_T, 0, ctx->comm);
+	hq_check(rc, "MPI_Scatter(fsums)", ctx->rank);
+
+	free(fsums);
+	return offset;
+}
+
+/**
+ * Parallel Sort Algorithm
+ *
+ * Every level splits the held elements in place about
+ * the consensus median, copies the kept side to the
+ * front of the other exchange buffer and receives the
+ * partner's side right behind it.
+ */
+void hq_sort_hypercube(struct hq_context* ctx, elem* data, size_t n, struct hq_result* res) {
+	/* Elements this rank holds, data until the first exchange */
+	elem* cur = data;
+	size_t cur_n = n;
+
+	for (int level = 0; level < ctx->levels; ++level) {
+		MPI_Comm comm = ctx->level_comms[level];
+		int localNumranks = ctx->numranks >> level;
+		int localRank = ctx->rank % localNumranks;
+
+#ifdef DEBUG_MODE
+		fprintf(stderr, "G_RANK(%d) G_NUMRANKS(%d) L_RANK(%d) L_NUMRANKS(%d)\n", ctx->rank, ctx->numranks, localRank, localNumranks);
+#endif
+
+		elem consensusMedian = hq_consensus_median(ctx, comm, localRank, localNumranks, cur, cur_n);
+
+		elem* mid = ctx->backend->partition(cur, cur + cur_n - 1, consensusMedian);
+		size_t l_sz = mid - cur;
+		size_t r_sz = cur_n - l_sz;
+
+		const int color = (localRank >= (localNumranks >> 1));
+		int src_rank;
+		size_t send_size;
+		elem* send_arr;
+		size_t keep_size;
+		elem* keep_arr;
+
+		if (color) { /* Right side */
+			keep_size = r_sz;
+			keep_arr = mid;
+			send_size = l_sz;
+			send_arr = cur;
+			src_rank = localRank - (localNumranks >> 1);
+		} else { /* Left side */
+			keep_size = l_sz;
+			keep_arr = cur;
+			send_size = r_sz;
+			send_arr = mid;
+			src_rank = localRank + (localNumranks >> 1);
+		}
+
+#ifdef DEBUG_MODE
+		fprintf(stderr, "G_RANK(%d) L_RANK(%d) sending send_size(%ld) to rank(%d)\n", ctx->rank, localRank, send_size, src_rank);
+#endif
+
+		size_t recv_size;
+		const elem* shm_src = NULL;
+		int on_node = 0;
+		if (ctx->shm) {
+			on_node = hq_shm_offer(ctx, level, send_arr, send_size, &shm_src, &recv_size);
+		}
+		size_t send_bytes = 0;
+		size_t recv_bytes = 0;
+		if (!on_node) {
+			send_bytes = hq_maybe_compress(ctx, send_arr, send_size);
+			recv_size = hq_exchange_size(ctx, comm, src_rank, send_size, send_bytes, &recv_bytes);
+		}
+
+#ifdef DEBUG_MODE
+		fprintf(stderr, "G_RANK(%d) L_RANK(%d) received recv_size(%ld) from rank(%d)\n", ctx->rank, localRank, recv_size, src_rank);
+#endif
+
+		elem* new_arr = hq_buffer(ctx, level % 2, keep_size + recv_size);
+		memcpy(new_arr, keep_arr, keep_size * sizeof(elem));
+		if (on_node) {
+			/* Partner is on this node, its half is read in place */
+			if (recv_size > 0) {
+				memcpy(new_arr + keep_size, shm_src, recv_size * sizeof(elem));
+			}
+		} else {
+			hq_exchange(ctx, comm, src_rank, send_arr, send_size, send_bytes, new_arr + keep_size, recv_size, recv_bytes);
+		}
+
+		cur = new_arr;
+		cur_n = keep_size + recv_size;
+	}
+
+	if (cur_n > 0) {
+		ctx->backend->sort(cur, cur + cur_n - 1);
+	}
+
+	res->data = cur;
+	res->n = cur_n;
+	res->offset = hq_offset(ctx, cur_n);
+}
+
+/* Gather every key on rank 0, sort them there and
+ * scatter them back in even slices (the last rank
+ * takes the remainder, like readfile()). total is
+ * the number of keys over all ranks, at most INT_MAX.
+ */
+void hq_sort_gather(struct hq_context* ctx, elem* data, size_t n, size_t total, struct hq_result* res) {
+	int rc;
+	int* counts = NULL;
+	int* displs = NULL;
+	int own = (int)n;
+	size_t delta = total / ctx->numranks;
+	size_t mine = ctx->rank + 1 == ctx->numranks ? total - delta * ctx->rank : delta;
+
+	/* Rank 0 gathers everything into the buffer its slice is scattered from */
+	elem* out = hq_buffer(ctx, 0, ctx->rank == 0 ? total : mine);
+
+	if (ctx->rank == 0) {
+		counts = (int*)calloc(ctx->numranks, sizeof(int));
+		displs = (int*)calloc(ctx->numranks, sizeof(int));
+		if (counts == NULL || displs == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): calloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+	}
+	rc = MPI_Gather(&own, 1, MPI_INT, counts, 1, MPI_INT, 0, ctx->comm);
+	hq_check(rc, "MPI_Gather(counts)", ctx->rank);
+	if (ctx->rank == 0) {
+		for (int i = 1; i < ctx->numranks; ++i) {
+			displs[i] = displs[i - 1] + counts[i - 1];
+		}
+	}
+	rc = MPI_Gatherv(data, own, MPI_INT32_T, out, counts, displs, MPI_INT32_T, 0, ctx->comm);
+	hq_check(rc, "MPI_Gatherv(data)", ctx->rank);
+
+	if (ctx->rank == 0) {
+		if (total > 0) {
+			ctx->backend->sort(out, out + total - 1);
+		}
+		for (int i = 0; i < ctx->numranks; ++i) {
+			displs[i] = (int)(delta * i);
+			counts[i] = i + 1 == ctx->numranks ? (int)(total - delta * i) : (int)delta;
+		}
+		rc = MPI_Scatterv(out, counts, displs, MPI_INT32_T, MPI_IN_PLACE, counts[0], MPI_INT32_T, 0, ctx->comm);
+	} else {
+		rc = MPI_Scatterv(NULL, NULL, NULL, MPI_INT32_T, out, (int)mine, MPI_INT32_T, 0, ctx->comm);
+	}
+	hq_check(rc, "MPI_Scatterv(data)", ctx->rank);
+	free(counts);
+	free(displs);
+
+	res->data = out;
+	res->n = mine;
+	res->offset = delta * ctx->rank;
+}
+
+/* Sample sort with a single all-to-all exchange: sort
+ * locally, pick numranks - 1 splitters from regular
+ * samples of every rank, send each rank the keys
+ * between its splitters and merge the sorted pieces.
+ */
+void hq_sort_samplesort(struct hq_context* ctx, elem* data, size_t n, struct hq_result* res) {
+	int rc;
+	int p = ctx->numranks;
+	if (n > 0) {
+		ctx->backend->sort(data, data + n - 1);
+	}
+
+	/* p - 1 regular samples of every rank, fewer if it has fewer keys */
+	int own_samples = n < (size_t)(p - 1) ? (int)n : p - 1;
+	elem* samples = (elem*)malloc(((size_t)p * p + p) * sizeof(elem));
+	int* counts = (int*)malloc(4 * p * sizeof(int));
+	if (samples == NULL || counts == NULL) {
+		fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	int* displs = counts + p;
+	int* recv_counts = counts + 2 * p;
+	int* recv_displs = counts + 3 * p;
+	elem* own = samples + (size_t)p * p;
+	for (int i = 0; i < own_samples; ++i) {
+		own[i] = data[(i + 1) * n / (own_samples + 1)];
+	}
+	rc = MPI_Allgather(&own_samples, 1, MPI_INT, counts, 1, MPI_INT, ctx->comm);
+	hq_check(rc, "MPI_Allgather(sample counts)", ctx->rank);
+	int num_samples = 0;
+	for (int i = 0; i < p; ++i) {
+		displs[i] = num_samples;
+		num_samples += counts[i];
+	}
+	rc = MPI_Allgatherv(own, own_samples, MPI_INT32_T, samples, counts, displs, MPI_INT32_T, ctx->comm);
+	hq_check(rc, "MPI_Allgatherv(samples)", ctx->rank);
+	if (num_samples > 0) {
+		m_natural_merge_sort(samples, samples + num_samples - 1);
+	}
+
+	/* Keys <= splitter i (and > splitter i - 1) go to rank i */
+	size_t from = 0;
+	for (int i = 0; i < p; ++i) {
+		size_t to = n;
+		if (i + 1 < p && num_samples > 0) {
+			elem splitter = samples[(size_t)(i + 1) * num_samples / p];
+			size_t lo = from;
+			while (lo < to) {
+				size_t mid = lo + (to - lo) / 2;
+				if (data[mid] <= splitter) {
+					lo = mid + 1;
+				} else {
+					to = mid;
+				}
+			}
+		}
+		displs[i] = (int)from;
+		counts[i] = (int)(to - from);
+		from = to;
+	}
+	free(samples);
+
+	rc = MPI_Alltoall(counts, 1, MPI_INT, recv_counts, 1, MPI_INT, ctx->comm);
+	hq_check(rc, "MPI_Alltoall(counts)", ctx->rank);
+	size_t recv_n = 0;
+	for (int i = 0; i < p; ++i) {
+		recv_displs[i] = (int)recv_n;
+		recv_n += recv_counts[i];
+	}
+	elem* out = hq_buffer(ctx, 0, recv_n);
+	rc = MPI_Alltoallv(data, counts, displs, MPI_INT32_T, out, recv_counts, recv_displs, MPI_INT32_T, ctx->comm);
+	hq_check(rc, "MPI_Alltoallv(data)", ctx->rank);
+	free(counts);
+
+	/* The pieces arrive as at most p sorted runs */
+	if (recv_n > 0) {
+		m_natural_merge_sort(out, out + recv_n - 1);
+	}
+
+	res->data = out;
+	res->n = recv_n;
+	res->offset = hq_offset(ctx, recv_n);
+}
+
+/* Measure what the cost model needs: the link (if
+ * hq_probe_link() has not run yet) and the speed of
+ * the backend's sort. Collective over comm.
+ */
+void hq_calibrate(struct hq_context* ctx) {
+	if (ctx->link_bandwidth == 0) {
+		hq_probe_link(ctx);
+	}
+	const size_t m = 1 << 16;
+	elem* keys = (elem*)malloc(m * sizeof(elem));
+	if (keys == NULL) {
+		fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	double best = 1e30;
+	for (int r = 0; r < 3; ++r) {
+		for (size_t i = 0; i < m; ++i) {
+			keys[i] = (elem)(((i + r) * 2654435761u) >> 1);
+		}
+		double t = MPI_Wtime();
+		ctx->backend->sort(keys, keys + m - 1);
+		t = MPI_Wtime() - t;
+		best = t < best ? t : best;
+	}
+	free(keys);
+	double own = best / (m * 16.0);
+	MPI_Allreduce(&own, &ctx->sort_sec_per_key, 1, MPI_DOUBLE, MPI_MAX, ctx->comm);
+}
+
+/* Predicted seconds of each algorithm for total keys
+ * spread evenly, from the link latency a, seconds per
+ * byte b and sort seconds per key and log2(keys) c.
+ */
+void hq_predict(struct hq_context* ctx, size_t total, double* predicted) {
+	double a = ctx->link_latency;
+	double b = 1.0 / ctx->link_bandwidth;
+	double c = ctx->sort_sec_per_key;
+	double w = sizeof(elem);
+	double p = ctx->numranks;
+	double lp = ctx->levels;
+	double big_n = total;
+	double n = big_n / p;
+	double log_n = n > 2 ? log2(n) : 1;
+	double log_total = big_n > 2 ? log2(big_n) : 1;
+
+	/* Gather and scatter through rank 0, which sorts everything */
+	predicted[HQ_ALGO_GATHER] = 2 * (a * lp + (big_n - n) * w * b) + c * big_n * log_total;
+
+	/* Every level: gather and broadcast of medians, a split
+	 * pass and half the keys swapped, then the local sort
+	 */
+	double level = 3 * a * lp + a + (n / 2) * w * b + c * n;
+	predicted[HQ_ALGO_HYPERCUBE] = lp * level + c * n * log_n;
+
+	/* Local sort, sample allgather, one all-to-all and a p-way merge */
+	predicted[HQ_ALGO_SAMPLESORT] = c * n * log_n + a * lp + p * (p - 1) * w * b + a * (p - 1)
+			+ n * (p - 1) / p * w * b + c * n * (lp > 1 ? lp : 1);
+}
+
+/* Sort data[0, n) of every rank, the result is in res */
+void hq_sort(struct hq_context* ctx, elem* data, size_t n, struct hq_result* res) {
+	if (ctx->presort && presort_try(data, n, ctx->comm, &ctx->presort_stats) != PRESORT_NONE) {
+		res->data = data;
+		res->n = n;
+		res->offset = hq_offset(ctx, n);
+		return;
+	}
+
+	int algorithm = ctx->algorithm;
+	if (algorithm != HQ_ALGO_HYPERCUBE && ctx->numranks > 1) {
+		uint64_t own = n;
+		uint64_t total;
+		int rc = MPI_Allreduce(&own, &total, 1, MPI_UINT64_T, MPI_SUM, ctx->comm);
+		hq_check(rc, "MPI_Allreduce(total)", ctx->rank);
+
+		if (algorithm == HQ_ALGO_AUTO) {
+			if (ctx->sort_sec_per_key == 0) {
+				hq_calibrate(ctx);
+			}
+			hq_predict(ctx, total, ctx->predicted);
+			algorithm = HQ_ALGO_HYPERCUBE;
+			for (int i = 0; i < HQ_NUM_ALGOS; ++i) {
+				algorithm = ctx->predicted[i] < ctx->predicted[algorithm] ? i : algorithm;
+			}
+		}
+		if (algorithm == HQ_ALGO_GATHER && total > INT_MAX) {
+			algorithm = HQ_ALGO_HYPERCUBE;
+		}
+		if (algorithm == HQ_ALGO_GATHER) {
+			ctx->last_algorithm = algorithm;
+			hq_sort_gather(ctx, data, n, total, res);
+			return;
+		}
+	}
+
+	ctx->last_algorithm = algorithm;
+	if (algorithm == HQ_ALGO_SAMPLESORT && ctx->numranks > 1) {
+		hq_sort_samplesort(ctx, data, n, res);
+	} else {
+		hq_sort_hypercube(ctx, data, n, res);
+	}
+}
+
+#endif
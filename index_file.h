@@ -0,0 +1,326 @@
+/* Indexed container for sorted output.
+ *
+ *   [header, 64 bytes]
+ *   [uint64 rank offsets, numranks + 1]  (index of each rank's first key)
+ *   [elem block minima, nblocks]
+ *   [elem block maxima, nblocks]
+ *   [keys, from data_offset, a multiple of INDEX_ALIGN]
+ *
+ * The keys are cut into blocks of block_keys keys
+ * (the last one may be shorter), each INDEX_ALIGN
+ * bytes, so a block is one aligned read. Since the
+ * keys are sorted, a block's minimum is its first key
+ * and its maximum its last, and each rank writes the
+ * fences of the blocks starting and ending in its own
+ * range. A lookup binary-searches the fences in memory
+ * and reads at most one block per bound.
+ *
+ * Files without the header are raw keys; the readers
+ * of filereader.h and shard_merge.h accept both.
+ */
+
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "serial_sort.h"
+
+#define INDEX_MAGIC "HQIDX001"
+
+/* Bytes of a block and alignment of the keys */
+#define INDEX_ALIGN 4096
+
+#define INDEX_BLOCK_KEYS (INDEX_ALIGN / sizeof(elem))
+
+/* Largest single write, counts are ints */
+#define INDEX_IO_CHUNK (1 << 30)
+
+/* Key types */
+#define INDEX_KEY_INT32 1
+
+/* Flags */
+#define INDEX_SORTED 1
+
+struct index_header {
+	char magic[8];
+	uint32_t key_type;
+	uint32_t key_size;
+	uint64_t count;
+	uint32_t flags;
+	uint32_t block_keys;
+	uint32_t numranks;
+	uint32_t reserved;
+	uint64_t data_offset;
+	uint64_t padding[2];
+};
+
+/* Blocks of a container of count keys */
+uint64_t index_blocks(uint64_t count) {
+	return (count + INDEX_BLOCK_KEYS - 1) / INDEX_BLOCK_KEYS;
+}
+
+/* Byte offset of the keys in a container of count keys written by numranks ranks */
+uint64_t index_data_offset(uint64_t count, int numranks) {
+	uint64_t end = sizeof(struct index_header) + (numranks + 1) * sizeof(uint64_t)
+			+ 2 * index_blocks(count) * sizeof(elem);
+	return (end + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+}
+
+/* Read the header of an open file if it has one. Returns 1 and
+ * fills h for a container, 0 for raw keys.
+ */
+int index_read_header(MPI_File fh, MPI_Offset fsize, struct index_header* h) {
+	if (fsize < (MPI_Offset)sizeof(struct index_header)) {
+		return 0;
+	}
+	MPI_Status status;
+	int got;
+	if (MPI_File_read_at(fh, 0, h, sizeof(struct index_header), MPI_CHAR, &status) != MPI_SUCCESS) {
+		return 0;
+	}
+	MPI_Get_count(&status, MPI_CHAR, &got);
+	return got == (int)sizeof(struct index_header) && 0 == memcmp(h->magic, INDEX_MAGIC, 8)
+			&& h->key_size == sizeof(elem) && h->data_offset + h->count * sizeof(elem) <= (uint64_t)fsize;
+}
+
+/* Where the keys of an open file of fsize bytes are: *base
+ * and *bytes, and its flags (0 for raw keys)
+ */
+void index_data_range(MPI_File fh, MPI_Offset fsize, MPI_Offset* base, MPI_Offset* bytes, uint32_t* flags) {
+	struct index_header h;
+	if (index_read_header(fh, fsize, &h)) {
+		*base = h.data_offset;
+		*bytes = h.count * sizeof(elem);
+		*flags = h.flags;
+	} else {
+		*base = 0;
+		*bytes = fsize;
+		*flags = 0;
+	}
+}
+
+/* Write the write_n bytes at buf to byte offset at of fh */
+int index_write_at(MPI_File fh, MPI_Offset at, const void* buf, uint64_t write_n) {
+	for (uint64_t done = 0; done < write_n; done += INDEX_IO_CHUNK) {
+		int chunk = write_n - done < INDEX_IO_CHUNK ? (int)(write_n - done) : INDEX_IO_CHUNK;
+		int rc = MPI_File_write_at(fh, at + done, (const char*)buf + done, chunk, MPI_CHAR, MPI_STATUS_IGNORE);
+		if (rc != MPI_SUCCESS) {
+			return rc;
+		}
+	}
+	return MPI_SUCCESS;
+}
+
+/* Write the sorted keys data[0, n), at global index offset, as a
+ * container to fname, collective over comm. flags go to the header.
+ */
+void index_write(const elem* data, size_t n, uint64_t offset, uint32_t flags, char* fname, MPI_Comm comm) {
+	char error_str[MPI_MAX_ERROR_STRING];
+	int errlen;
+	int rank, numranks;
+	int rc;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &numranks);
+
+	uint64_t own = n;
+	uint64_t count;
+	MPI_Allreduce(&own, &count, 1, MPI_UINT64_T, MPI_SUM, comm);
+	uint64_t nblocks = index_blocks(count);
+	uint64_t data_offset = index_data_offset(count, numranks);
+	MPI_Offset mins_at = sizeof(struct index_header) + (numranks + 1) * sizeof(uint64_t);
+	MPI_Offset maxs_at = mins_at + nblocks * sizeof(elem);
+
+	uint64_t* offsets = NULL;
+	if (rank == 0) {
+		offsets = (uint64_t*)malloc((numranks + 1) * sizeof(uint64_t));
+		if (offsets == NULL) {
+			fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		offsets[numranks] = count;
+	}
+	MPI_Gather(&offset, 1, MPI_UINT64_T, offsets, 1, MPI_UINT64_T, 0, comm);
+
+	MPI_File fh;
+	rc = MPI_File_open(comm, fname, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &fh);
+	int opened = (rc == MPI_SUCCESS);
+	if (rc == MPI_SUCCESS) {
+		rc = MPI_File_set_size(fh, 0);
+	}
+
+	if (rc == MPI_SUCCESS && rank == 0) {
+		struct index_header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, INDEX_MAGIC, 8);
+		h.key_type = INDEX_KEY_INT32;
+		h.key_size = sizeof(elem);
+		h.count = count;
+		h.flags = flags;
+		h.block_keys = INDEX_BLOCK_KEYS;
+		h.numranks = numranks;
+		h.data_offset = data_offset;
+		rc = index_write_at(fh, 0, &h, sizeof(h));
+		if (rc == MPI_SUCCESS) {
+			rc = index_write_at(fh, sizeof(h), offsets, (numranks + 1) * sizeof(uint64_t));
+		}
+	}
+
+	/* Minima of the blocks starting here: their first keys, at a stride of one block */
+	uint64_t first_block = (offset + INDEX_BLOCK_KEYS - 1) / INDEX_BLOCK_KEYS;
+	uint64_t end_block = (offset + n + INDEX_BLOCK_KEYS - 1) / INDEX_BLOCK_KEYS;
+	uint64_t nfences = end_block > first_block ? end_block - first_block : 0;
+	elem* fences = (elem*)malloc((n / INDEX_BLOCK_KEYS + 2) * sizeof(elem));
+	if (fences == NULL) {
+		fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	for (uint64_t b = first_block; b < end_block; ++b) {
+		fences[b - first_block] = data[b * INDEX_BLOCK_KEYS - offset];
+	}
+	if (rc == MPI_SUCCESS) {
+		rc = index_write_at(fh, mins_at + first_block * sizeof(elem), fences, nfences * sizeof(elem));
+	}
+
+	/* Maxima of the blocks ending here: their last keys */
+	first_block = offset / INDEX_BLOCK_KEYS;
+	end_block = first_block;
+	while (end_block < nblocks) {
+		uint64_t last = (end_block + 1) * INDEX_BLOCK_KEYS - 1;
+		last = last < count ? last : count - 1;
+		if (last >= offset + n) {
+			break;
+		}
+		++end_block;
+	}
+	nfences = end_block - first_block;
+	for (uint64_t b = first_block; b < end_block; ++b) {
+		uint64_t last = (b + 1) * INDEX_BLOCK_KEYS - 1;
+		last = last < count ? last : count - 1;
+		fences[b - first_block] = data[last - offset];
+	}
+	if (rc == MPI_SUCCESS) {
+		rc = index_write_at(fh, maxs_at + first_block * sizeof(elem), fences, nfences * sizeof(elem));
+	}
+
+	if (rc == MPI_SUCCESS) {
+		rc = index_write_at(fh, data_offset + offset * sizeof(elem), data, n * sizeof(elem));
+	}
+
+	/* The close is collective, every rank reaches it before any gives up */
+	if (opened) {
+		int close_rc = MPI_File_close(&fh);
+		rc = rc == MPI_SUCCESS ? close_rc : rc;
+	}
+	int failed = (rc != MPI_SUCCESS);
+	int any_failed = 0;
+	MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, comm);
+	if (failed) {
+		MPI_Error_string(rc, error_str, &errlen);
+		fprintf(stderr, "ERROR rank(%d): writing %s failed with error code (%d): %s\n", rank, fname, rc, error_str);
+	}
+	if (any_failed) {
+		exit(EXIT_FAILURE);
+	}
+	free(fences);
+	free(offsets);
+}
+
+/* A container opened for lookups by one process */
+struct index_file {
+	MPI_File fh;
+	struct index_header h;
+	uint64_t nblocks;
+	elem* mins;
+	elem* maxs;
+
+	/* The last block read */
+	elem* block;
+	int64_t cached;
+
+	/* Blocks read by lookups */
+	uint64_t block_reads;
+};
+
+/* Open fname and read its fences. Returns 0, or -1 if it is
+ * not a sorted container.
+ */
+int index_open(struct index_file* f, char* fname) {
+	if (MPI_File_open(MPI_COMM_SELF, fname, MPI_MODE_RDONLY, MPI_INFO_NULL, &f->fh) != MPI_SUCCESS) {
+		return -1;
+	}
+	MPI_Offset fsize;
+	MPI_File_get_size(f->fh, &fsize);
+	if (!index_read_header(f->fh, fsize, &f->h) || !(f->h.flags & INDEX_SORTED)
+			|| f->h.block_keys != INDEX_BLOCK_KEYS) {
+		MPI_File_close(&f->fh);
+		return -1;
+	}
+	f->nblocks = index_blocks(f->h.count);
+	f->mins = (elem*)malloc((2 * f->nblocks + 1) * sizeof(elem));
+	f->block = (elem*)malloc(INDEX_BLOCK_KEYS * sizeof(elem));
+	if (f->mins == NULL || f->block == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	f->maxs = f->mins + f->nblocks;
+	MPI_Offset mins_at = sizeof(struct index_header) + (f->h.numranks + 1) * sizeof(uint64_t);
+	MPI_File_read_at(f->fh, mins_at, f->mins, (int)(2 * f->nblocks), MPI_INT32_T, MPI_STATUS_IGNORE);
+	f->cached = -1;
+	f->block_reads = 0;
+	return 0;
+}
+
+void index_close(struct index_file* f) {
+	MPI_File_close(&f->fh);
+	free(f->mins);
+	free(f->block);
+}
+
+/* Global index of the first key > v (strict) or >= v. Reads
+ * at most the one block holding it, none when it starts a block.
+ */
+uint64_t index_bound(struct index_file* f, elem v, int strict) {
+	/* First block whose maximum passes v */
+	uint64_t lo = 0;
+	uint64_t hi = f->nblocks;
+	while (lo < hi) {
+		uint64_t m = lo + (hi - lo) / 2;
+		if (strict ? f->maxs[m] <= v : f->maxs[m] < v) {
+			lo = m + 1;
+		} else {
+			hi = m;
+		}
+	}
+	if (lo == f->nblocks) {
+		return f->h.count;
+	}
+	uint64_t base = lo * INDEX_BLOCK_KEYS;
+	if (strict ? f->mins[lo] > v : f->mins[lo] >= v) {
+		return base;
+	}
+
+	uint64_t len = f->h.count - base < INDEX_BLOCK_KEYS ? f->h.count - base : INDEX_BLOCK_KEYS;
+	if (f->cached != (int64_t)lo) {
+		MPI_File_read_at(f->fh, f->h.data_offset + base * sizeof(elem), f->block, (int)len, MPI_INT32_T,
+				MPI_STATUS_IGNORE);
+		f->cached = lo;
+		f->block_reads += 1;
+	}
+	uint64_t l = 0;
+	uint64_t r = len;
+	while (l < r) {
+		uint64_t m = l + (r - l) / 2;
+		if (strict ? f->block[m] <= v : f->block[m] < v) {
+			l = m + 1;
+		} else {
+			r = m;
+		}
+	}
+	return base + l;
+}
+
+#endif
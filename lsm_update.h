@@ -0,0 +1,625 @@
+/* Incremental updates of a partitioned output.
+ *
+ *   struct lsm_state st;
+ *   lsm_parse(&st, manifest_text, manifest, comm);
+ *   if (lsm_update(&ctx, &st, delta, n, ratio, manifest, vs, &stats) == 0) {
+ *       lsm_commit(&st, manifest, comm);
+ *   }
+ *
+ * The state is what --partitioned writes: every rank's
+ * sorted slice in its own file and a manifest listing
+ * them with their minimum and maximum keys. The
+ * maxima are the splitters: keys <= upper[0] belong to
+ * rank 0, keys in (upper[i - 1], upper[i]] to rank i,
+ * and anything above to the last rank.
+ *
+ * An update sorts each rank's share of the delta and
+ * routes it to the owning ranks with one Alltoallv.
+ * Each rank then keeps its slice as a stack of sorted
+ * runs, oldest and largest first, like an LSM tree:
+ * the delta becomes the newest run, and while it holds
+ * at least 1 / LSM_GROWTH of the run below, the two
+ * are merged. Run sizes thus grow geometrically, a
+ * rank has O(log n) runs, and an update reads and
+ * writes O(delta * log(n / delta)) keys amortized, not
+ * the whole slice. Runs are plain sorted key files, so
+ * the manifest remains a --merge shard list.
+ *
+ * Only when the largest slice exceeds ratio times the
+ * mean, all runs are merged and the keys are spread
+ * evenly over the ranks again, which moves the
+ * splitters.
+ *
+ * New runs get names of the next generation, the
+ * manifest is replaced by a rename, and only then are
+ * the runs it no longer lists removed, so a failed
+ * update leaves the previous state intact.
+ */
+
+#ifndef LSM_UPDATE_H
+#define LSM_UPDATE_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "serial_sort.h"
+#include "hyperquicksort.h"
+#include "partfile.h"
+#include "verify.h"
+
+/* The newest run is merged into the one below while it holds at least 1 / LSM_GROWTH of its keys */
+#define LSM_GROWTH 2
+
+/* Default largest slice over the mean slice that triggers a rebalance */
+#define LSM_REBALANCE 1.5
+
+/* One sorted run of a rank */
+struct lsm_run {
+	char path[PART_PATH_MAX];
+	uint64_t records;
+	int64_t min;
+	int64_t max;
+};
+
+struct lsm_state {
+	/* Ranks the state was written by, and the updates since */
+	int numranks;
+	uint64_t generation;
+
+	/* This rank's runs, oldest first */
+	struct lsm_run* runs;
+	int nruns;
+
+	/* upper[i]: largest key of ranks 0..i, INT_MIN - 1 before any */
+	int64_t* upper;
+
+	/* Runs replaced by the update, removed by lsm_commit() */
+	struct lsm_run* obsolete;
+	int nobsolete;
+};
+
+/* What an update did, for the report */
+struct lsm_stats {
+	/* Keys of the delta read and sent to another rank */
+	uint64_t ingested;
+	uint64_t routed;
+
+	/* Keys of existing runs read back to merge, and keys written */
+	uint64_t merged;
+	uint64_t written;
+
+	/* Runs this rank holds after the update */
+	int runs;
+
+	/* Largest slice over the mean with the delta added, and whether that rebalanced */
+	double imbalance;
+	int rebalanced;
+};
+
+/* Print why this rank failed, returns -1. The ranks agree on failures with lsm_any_failed() */
+int lsm_fail(const char* what, const char* path, int rank) {
+	fprintf(stderr, "ERROR rank(%d): %s %s failed: %s\n", rank, what, path, strerror(errno));
+	return -1;
+}
+
+/* Whether any rank failed, collective over ctx->comm */
+int lsm_any_failed(struct hq_context* ctx, int failed) {
+	int any = 0;
+	hq_check(MPI_Allreduce(&failed, &any, 1, MPI_INT, MPI_MAX, ctx->comm), "MPI_Allreduce(update failed)", ctx->rank);
+	return any;
+}
+
+/* Read run r into out, which has room for r->records keys, returns 0 or -1 */
+int lsm_read_run(const struct lsm_run* r, elem* out, int rank) {
+	int fd = open(r->path, O_RDONLY);
+	if (fd < 0) {
+		return lsm_fail("opening run", r->path, rank);
+	}
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size != (off_t)(r->records * sizeof(elem))) {
+		fprintf(stderr, "ERROR rank(%d): run %s has %lld bytes, the manifest lists %llu keys\n", rank, r->path,
+				(long long)size, (unsigned long long)r->records);
+		close(fd);
+		return -1;
+	}
+	char* at = (char*)out;
+	size_t left = r->records * sizeof(elem);
+	off_t offset = 0;
+	while (left > 0) {
+		ssize_t done = pread(fd, at, left, offset);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			if (done == 0) {
+				errno = EIO;
+			}
+			lsm_fail("reading run", r->path, rank);
+			close(fd);
+			return -1;
+		}
+		at += done;
+		left -= done;
+		offset += done;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Parse the manifest text (from --partitioned or an earlier
+ * update) into st, keeping the runs of this rank. The text is
+ * modified. Collective only in that every rank parses it.
+ */
+void lsm_parse(struct lsm_state* st, char* text, const char* manifest, MPI_Comm comm) {
+	int rank, numranks;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &numranks);
+
+	int lines = 1;
+	for (char* c = text; *c != '\0'; ++c) {
+		lines += (*c == '\n');
+	}
+	st->runs = (struct lsm_run*)malloc((lines + 1) * sizeof(struct lsm_run));
+	st->obsolete = (struct lsm_run*)malloc((lines + 1) * sizeof(struct lsm_run));
+	st->upper = (int64_t*)malloc(numranks * sizeof(int64_t));
+	if (st->runs == NULL || st->obsolete == NULL || st->upper == NULL) {
+		fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	st->nruns = 0;
+	st->nobsolete = 0;
+	st->generation = 0;
+	st->numranks = 0;
+	for (int i = 0; i < numranks; ++i) {
+		st->upper[i] = (int64_t)INT_MIN - 1;
+	}
+
+	/* <path> <records> <first index> <min key> <max key> [<rank>], ranks in line order if missing */
+	int line_no = 0;
+	char* save_line;
+	for (char* line = strtok_r(text, "\n", &save_line); line != NULL; line = strtok_r(NULL, "\n", &save_line)) {
+		unsigned long long generation;
+		if (sscanf(line, "# generation %llu", &generation) == 1) {
+			st->generation = generation;
+		}
+		char* hash = strchr(line, '#');
+		if (hash != NULL) {
+			*hash = '\0';
+		}
+		char path[PART_PATH_MAX];
+		unsigned long long records, first;
+		char min[32], max[32];
+		int owner = line_no;
+		int fields = sscanf(line, "%4095s %llu %llu %31s %31s %d", path, &records, &first, min, max, &owner);
+		if (fields <= 0) {
+			continue;
+		}
+		if (fields < 5 || owner < 0) {
+			fprintf(stderr, "ERROR rank(%d): %s is not a partitioned manifest: %s\n", rank, manifest, line);
+			exit(EXIT_FAILURE);
+		}
+		++line_no;
+		st->numranks = owner + 1 > st->numranks ? owner + 1 : st->numranks;
+		if (owner >= numranks) {
+			continue;
+		}
+		if (records > 0 && (strcmp(min, "-") == 0 || strcmp(max, "-") == 0)) {
+			fprintf(stderr, "ERROR rank(%d): %s lists %s without keys\n", rank, manifest, path);
+			exit(EXIT_FAILURE);
+		}
+		int64_t lo = records > 0 ? strtoll(min, NULL, 10) : 0;
+		int64_t hi = records > 0 ? strtoll(max, NULL, 10) : 0;
+		if (records > 0 && hi > st->upper[owner]) {
+			st->upper[owner] = hi;
+		}
+		if (owner == rank) {
+			struct lsm_run* r = &st->runs[st->nruns++];
+			snprintf(r->path, sizeof(r->path), "%s", path);
+			r->records = records;
+			r->min = lo;
+			r->max = hi;
+		}
+	}
+	if (st->numranks != numranks) {
+		if (rank == 0) {
+			fprintf(stderr, "ERROR: %s holds the slices of %d ranks, update it with %d ranks\n", manifest,
+					st->numranks, st->numranks);
+		}
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	for (int i = 1; i < numranks; ++i) {
+		st->upper[i] = st->upper[i] > st->upper[i - 1] ? st->upper[i] : st->upper[i - 1];
+	}
+}
+
+void lsm_free(struct lsm_state* st) {
+	free(st->runs);
+	free(st->obsolete);
+	free(st->upper);
+}
+
+/* Merge sorted a[0, na) and b[0, nb) into out */
+void lsm_merge(const elem* a, size_t na, const elem* b, size_t nb, elem* out) {
+	size_t x = 0;
+	size_t y = 0;
+	size_t o = 0;
+	while (x < na && y < nb) {
+		out[o++] = b[y] < a[x] ? b[y++] : a[x++];
+	}
+	while (x < na) {
+		out[o++] = a[x++];
+	}
+	while (y < nb) {
+		out[o++] = b[y++];
+	}
+}
+
+/* Write keys[0, n) as run path of this rank, hashing and checking them for the verification.
+ * Returns 0 or -1, and st only lists the run once it is written.
+ */
+int lsm_write_run(struct lsm_state* st, const char* path, const elem* keys, size_t n, struct verify_state* vs,
+		struct lsm_stats* stats, int rank) {
+	if (part_write_buffered(path, keys, n * sizeof(elem)) != 0) {
+		return lsm_fail("writing run", path, rank);
+	}
+	struct lsm_run* r = &st->runs[st->nruns++];
+	snprintf(r->path, sizeof(r->path), "%s", path);
+	r->records = n;
+	r->min = keys[0];
+	r->max = keys[n - 1];
+	stats->written += n;
+	if (vs != NULL) {
+		verify_after(vs, keys, keys + n - 1);
+	}
+	return 0;
+}
+
+/* Room for n keys */
+elem* lsm_alloc(size_t n, int rank) {
+	elem* p = (elem*)malloc((n + 1) * sizeof(elem));
+	if (p == NULL) {
+		fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	return p;
+}
+
+/* Read all runs of this rank after keys[0, n) and merge the lot, returns the new array or NULL */
+elem* lsm_gather_runs(struct lsm_state* st, elem* keys, size_t n, size_t* total, struct verify_state* vs,
+		struct lsm_stats* stats, int rank) {
+	size_t all = n;
+	for (int i = 0; i < st->nruns; ++i) {
+		all += st->runs[i].records;
+	}
+	elem* out = lsm_alloc(all, rank);
+	memcpy(out, keys, n * sizeof(elem));
+	size_t at = n;
+	for (int i = 0; i < st->nruns; ++i) {
+		if (lsm_read_run(&st->runs[i], out + at, rank) != 0) {
+			free(out);
+			return NULL;
+		}
+		if (vs != NULL) {
+			for (uint64_t k = 0; k < st->runs[i].records; ++k) {
+				multiset_hash_add(&vs->before, out[at + k]);
+			}
+		}
+		at += st->runs[i].records;
+		stats->merged += st->runs[i].records;
+		st->obsolete[st->nobsolete++] = st->runs[i];
+	}
+	st->nruns = 0;
+	if (all > 0) {
+		m_natural_merge_sort(out, out + all - 1);
+	}
+	*total = all;
+	return out;
+}
+
+/* Spread the sorted keys[0, n) of every rank evenly over the ranks, like readfile() splits an input */
+elem* lsm_spread(struct hq_context* ctx, elem* keys, size_t n, size_t* out_n) {
+	const int p = ctx->numranks;
+	uint64_t own = n;
+	uint64_t first = 0;
+	uint64_t total = 0;
+	hq_check(MPI_Exscan(&own, &first, 1, MPI_UINT64_T, MPI_SUM, ctx->comm), "MPI_Exscan(slice sizes)", ctx->rank);
+	hq_check(MPI_Allreduce(&own, &total, 1, MPI_UINT64_T, MPI_SUM, ctx->comm), "MPI_Allreduce(slice sizes)",
+			ctx->rank);
+	first = ctx->rank == 0 ? 0 : first;
+
+	int* counts = (int*)malloc(4 * p * sizeof(int));
+	if (counts == NULL) {
+		fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	int* displs = counts + p;
+	int* recv_counts = counts + 2 * p;
+	int* recv_displs = counts + 3 * p;
+
+	/* Rank i gets [i * delta, (i + 1) * delta), the last one the rest */
+	uint64_t delta = total / p;
+	for (int i = 0; i < p; ++i) {
+		uint64_t lo = delta * i;
+		uint64_t hi = i + 1 == p ? total : lo + delta;
+		lo = lo > first ? lo : first;
+		hi = hi < first + n ? hi : first + n;
+		displs[i] = hi > lo ? (int)(lo - first) : 0;
+		counts[i] = hi > lo ? (int)(hi - lo) : 0;
+	}
+	hq_check(MPI_Alltoall(counts, 1, MPI_INT, recv_counts, 1, MPI_INT, ctx->comm), "MPI_Alltoall(spread counts)",
+			ctx->rank);
+	size_t recv_n = 0;
+	for (int i = 0; i < p; ++i) {
+		recv_displs[i] = (int)recv_n;
+		recv_n += recv_counts[i];
+	}
+	elem* out = lsm_alloc(recv_n, ctx->rank);
+	hq_check(MPI_Alltoallv(keys, counts, displs, MPI_INT32_T, out, recv_counts, recv_displs, MPI_INT32_T, ctx->comm),
+			"MPI_Alltoallv(spread)", ctx->rank);
+	free(counts);
+
+	/* The pieces arrive in rank order, which is key order */
+	*out_n = recv_n;
+	return out;
+}
+
+/* Add the n keys of delta (this rank's share of the new keys,
+ * reordered) to the state, collective over ctx->comm. The new
+ * runs are written under fwrpath, the manifest is left to
+ * lsm_commit(). With vs set, vs->before holds the hash of delta
+ * and whatever existing runs were read, vs->after that of the
+ * written runs, and vs->unsorted their descents.
+ *
+ * Returns 0, or -1 on every rank if a run could not be read or
+ * written on any rank. The run this rank wrote is removed again
+ * then, and st must not be committed.
+ */
+int lsm_update(struct hq_context* ctx, struct lsm_state* st, elem* delta, size_t n, double ratio, const char* fwrpath,
+		struct verify_state* vs, struct lsm_stats* stats) {
+	const int p = ctx->numranks;
+	memset(stats, 0, sizeof(*stats));
+	stats->ingested = n;
+	if (n > 0) {
+		ctx->backend->sort(delta, delta + n - 1);
+	}
+
+	/* Keys <= upper[i] (and > upper[i - 1]) go to rank i, the rest to the last one */
+	int* counts = (int*)malloc(4 * p * sizeof(int));
+	if (counts == NULL) {
+		fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	int* displs = counts + p;
+	int* recv_counts = counts + 2 * p;
+	int* recv_displs = counts + 3 * p;
+	size_t from = 0;
+	for (int i = 0; i < p; ++i) {
+		size_t to = n;
+		if (i + 1 < p) {
+			size_t lo = from;
+			while (lo < to) {
+				size_t mid = lo + (to - lo) / 2;
+				if (delta[mid] <= st->upper[i]) {
+					lo = mid + 1;
+				} else {
+					to = mid;
+				}
+			}
+		}
+		displs[i] = (int)from;
+		counts[i] = (int)(to - from);
+		stats->routed += (i != ctx->rank) ? to - from : 0;
+		from = to;
+	}
+	hq_check(MPI_Alltoall(counts, 1, MPI_INT, recv_counts, 1, MPI_INT, ctx->comm), "MPI_Alltoall(delta counts)",
+			ctx->rank);
+	size_t recv_n = 0;
+	for (int i = 0; i < p; ++i) {
+		recv_displs[i] = (int)recv_n;
+		recv_n += recv_counts[i];
+	}
+	elem* top = lsm_alloc(recv_n, ctx->rank);
+	hq_check(MPI_Alltoallv(delta, counts, displs, MPI_INT32_T, top, recv_counts, recv_displs, MPI_INT32_T, ctx->comm),
+			"MPI_Alltoallv(delta)", ctx->rank);
+	free(counts);
+
+	/* The pieces arrive as at most p sorted runs */
+	if (recv_n > 0) {
+		m_natural_merge_sort(top, top + recv_n - 1);
+	}
+
+	/* Slice sizes after the update decide whether to rebalance */
+	uint64_t slice = recv_n;
+	for (int i = 0; i < st->nruns; ++i) {
+		slice += st->runs[i].records;
+	}
+	uint64_t largest = 0;
+	uint64_t total = 0;
+	hq_check(MPI_Allreduce(&slice, &largest, 1, MPI_UINT64_T, MPI_MAX, ctx->comm), "MPI_Allreduce(largest slice)",
+			ctx->rank);
+	hq_check(MPI_Allreduce(&slice, &total, 1, MPI_UINT64_T, MPI_SUM, ctx->comm), "MPI_Allreduce(total)", ctx->rank);
+	stats->imbalance = total > 0 ? (double)largest * p / total : 1.0;
+	stats->rebalanced = stats->imbalance > ratio;
+
+	int failed = 0;
+	char path[PART_PATH_MAX];
+	snprintf(path, sizeof(path), "%s.%05d.%llu", fwrpath, ctx->rank, (unsigned long long)st->generation + 1);
+
+	if (stats->rebalanced) {
+		size_t all;
+		elem* merged = lsm_gather_runs(st, top, recv_n, &all, vs, stats, ctx->rank);
+		free(top);
+		/* lsm_spread() is collective, so every rank stops here together */
+		if (lsm_any_failed(ctx, merged == NULL)) {
+			free(merged);
+			return -1;
+		}
+		top = lsm_spread(ctx, merged, all, &recv_n);
+		free(merged);
+	} else {
+		/* Merge the newest runs into the delta while it is not much smaller */
+		while (recv_n > 0 && st->nruns > 0 && recv_n * LSM_GROWTH >= st->runs[st->nruns - 1].records) {
+			struct lsm_run* below = &st->runs[st->nruns - 1];
+			elem* keys = lsm_alloc(below->records, ctx->rank);
+			elem* merged = lsm_alloc(recv_n + below->records, ctx->rank);
+			if (lsm_read_run(below, keys, ctx->rank) != 0) {
+				failed = 1;
+				free(keys);
+				free(merged);
+				break;
+			}
+			if (vs != NULL) {
+				for (uint64_t k = 0; k < below->records; ++k) {
+					multiset_hash_add(&vs->before, keys[k]);
+				}
+			}
+			lsm_merge(keys, below->records, top, recv_n, merged);
+			stats->merged += below->records;
+			recv_n += below->records;
+			st->obsolete[st->nobsolete++] = *below;
+			--st->nruns;
+			free(keys);
+			free(top);
+			top = merged;
+		}
+	}
+	if (recv_n > 0 && !failed) {
+		failed = lsm_write_run(st, path, top, recv_n, vs, stats, ctx->rank) != 0;
+	}
+	free(top);
+	if (lsm_any_failed(ctx, failed)) {
+		/* Nobody lists the new run yet, the previous state stays as it was */
+		if (unlink(path) != 0 && errno != ENOENT) {
+			fprintf(stderr, "WARNING rank(%d): removing %s failed: %s\n", ctx->rank, path, strerror(errno));
+		}
+		return -1;
+	}
+	st->generation += 1;
+	stats->runs = st->nruns;
+
+	if (vs != NULL) {
+		/* Slices must follow each other: the largest key of the last non-empty rank before this one */
+		int64_t own[3] = { 0, 0, 0 };
+		for (int i = 0; i < st->nruns; ++i) {
+			if (st->runs[i].records > 0) {
+				own[1] = own[0] == 0 || st->runs[i].min < own[1] ? st->runs[i].min : own[1];
+				own[2] = own[0] == 0 || st->runs[i].max > own[2] ? st->runs[i].max : own[2];
+				own[0] = 1;
+			}
+		}
+		int64_t* all = (int64_t*)malloc(3 * p * sizeof(int64_t));
+		if (all == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		hq_check(MPI_Allgather(own, 3, MPI_INT64_T, all, 3, MPI_INT64_T, ctx->comm), "MPI_Allgather(slice keys)",
+				ctx->rank);
+		int before = ctx->rank - 1;
+		while (before >= 0 && all[3 * before] == 0) {
+			--before;
+		}
+		vs->unsorted += (own[0] && before >= 0 && all[3 * before + 2] > own[1]);
+		free(all);
+	}
+	return 0;
+}
+
+/* Write the manifest of st to fwrpath (through a rename) and
+ * remove the runs the update replaced. Collective over comm.
+ */
+void lsm_commit(struct lsm_state* st, char* fwrpath, MPI_Comm comm) {
+	int rank, numranks;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &numranks);
+
+	uint64_t own = 0;
+	for (int i = 0; i < st->nruns; ++i) {
+		own += st->runs[i].records;
+	}
+	uint64_t first = 0;
+	MPI_Exscan(&own, &first, 1, MPI_UINT64_T, MPI_SUM, comm);
+	first = rank == 0 ? 0 : first;
+
+	/* Every rank's runs, and the first index of its slice */
+	int bytes = st->nruns * (int)sizeof(struct lsm_run);
+	int* counts = NULL;
+	int* displs = NULL;
+	uint64_t* firsts = NULL;
+	char* all = NULL;
+	if (rank == 0) {
+		counts = (int*)malloc(2 * numranks * sizeof(int));
+		firsts = (uint64_t*)malloc(numranks * sizeof(uint64_t));
+		if (counts == NULL || firsts == NULL) {
+			fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		displs = counts + numranks;
+	}
+	MPI_Gather(&bytes, 1, MPI_INT, counts, 1, MPI_INT, 0, comm);
+	MPI_Gather(&first, 1, MPI_UINT64_T, firsts, 1, MPI_UINT64_T, 0, comm);
+	if (rank == 0) {
+		int total = 0;
+		for (int i = 0; i < numranks; ++i) {
+			displs[i] = total;
+			total += counts[i];
+		}
+		all = (char*)malloc(total + 1);
+		if (all == NULL) {
+			fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+	}
+	MPI_Gatherv(st->runs, bytes, MPI_BYTE, all, counts, displs, MPI_BYTE, 0, comm);
+
+	int ok = 1;
+	if (rank == 0) {
+		char tmp[PART_PATH_MAX + 8];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", fwrpath);
+		FILE* f = fopen(tmp, "w");
+		ok = (f != NULL);
+		if (ok) {
+			fprintf(f, "# <path> <records> <first index> <min key> <max key> <rank>\n");
+			fprintf(f, "# generation %llu\n", (unsigned long long)st->generation);
+			for (int i = 0; i < numranks; ++i) {
+				const struct lsm_run* runs = (const struct lsm_run*)(all + displs[i]);
+				int n = counts[i] / (int)sizeof(struct lsm_run);
+				for (int k = 0; k < n; ++k) {
+					fprintf(f, "%s %llu %llu", runs[k].path, (unsigned long long)runs[k].records,
+							(unsigned long long)firsts[i]);
+					if (runs[k].records > 0) {
+						fprintf(f, " %lld %lld %d\n", (long long)runs[k].min, (long long)runs[k].max, i);
+					} else {
+						fprintf(f, " - - %d\n", i);
+					}
+				}
+			}
+			ok = (fclose(f) == 0) && rename(tmp, fwrpath) == 0;
+		}
+		if (!ok) {
+			fprintf(stderr, "ERROR rank(%d): writing manifest %s failed: %s\n", rank, fwrpath, strerror(errno));
+		}
+		free(counts);
+		free(firsts);
+		free(all);
+	}
+	MPI_Bcast(&ok, 1, MPI_INT, 0, comm);
+	if (!ok) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* The manifest no longer lists these */
+	for (int i = 0; i < st->nobsolete; ++i) {
+		if (unlink(st->obsolete[i].path) != 0 && errno != ENOENT) {
+			fprintf(stderr, "WARNING rank(%d): removing %s failed: %s\n", rank, st->obsolete[i].path, strerror(errno));
+		}
+	}
+	st->nobsolete = 0;
+}
+
+#endif
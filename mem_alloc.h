@@ -0,0 +1,191 @@
+/* Allocation of the sort's data buffers.
+ *
+ * mem_alloc() maps the buffers itself when a policy is
+ * set with mem_policy_init():
+ *
+ * -- huge pages, either transparent ones requested with
+ *    madvise(MADV_HUGEPAGE) or explicit ones from the
+ *    hugetlbfs pool with MAP_HUGETLB. When the pool is
+ *    empty the mapping falls back to transparent pages.
+ *
+ * -- binding to the NUMA node the rank runs on with
+ *    mbind(MPOL_BIND). Ranks should be pinned (e.g.
+ *    mpirun --bind-to socket) for the node to stay right.
+ *
+ * Every page is then touched once by the rank, so it is
+ * placed before any other process (or the NIC) sees it.
+ * Without a policy it is plain malloc().
+ *
+ * Needs _DEFAULT_SOURCE for MAP_ANONYMOUS and syscall().
+ */
+
+#ifndef MEM_ALLOC_H
+#define MEM_ALLOC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define MEM_HUGE_OFF 0
+#define MEM_HUGE_THP 1
+#define MEM_HUGE_TLB 2
+
+/* Size of an explicit huge page, mappings are rounded up to it */
+#define MEM_HUGE_PAGE_SIZE (2UL << 20)
+
+/* mbind() mode from <numaif.h>, which needs libnuma */
+#define MEM_MPOL_BIND 2
+
+/* Room in front of every buffer for its mem_header */
+#define MEM_HEADER_SIZE 64
+
+struct mem_header {
+	/* Bytes mapped, 0 when the buffer came from malloc() */
+	size_t mapped;
+};
+
+struct mem_policy {
+	/* Requested page size, one of MEM_HUGE_* */
+	int huge;
+
+	/* Bind buffers to the rank's NUMA node */
+	int numa;
+
+	/* NUMA node of the rank, -1 if unknown */
+	int node;
+
+	/* What happened, for the report */
+	size_t maps;
+	size_t tlb_fallbacks;
+	size_t bind_failures;
+};
+
+struct mem_policy mem_policy = { MEM_HUGE_OFF, 0, -1, 0, 0, 0 };
+
+const char* mem_huge_name(int huge) {
+	switch (huge) {
+		case MEM_HUGE_THP: return "thp";
+		case MEM_HUGE_TLB: return "hugetlb";
+		default: return "off";
+	}
+}
+
+/* Set the policy of the buffers allocated from now on */
+void mem_policy_init(int huge, int numa) {
+	mem_policy.huge = huge;
+	mem_policy.numa = numa;
+	mem_policy.node = -1;
+#ifdef SYS_getcpu
+	unsigned cpu;
+	unsigned node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+		mem_policy.node = (int)node;
+	}
+#endif
+}
+
+/* Bind [p, p + bytes) to the rank's node, returns 0 on success */
+int mem_bind(void* p, size_t bytes) {
+#ifdef SYS_mbind
+	if (mem_policy.node < 0 || mem_policy.node >= 64) {
+		return -1;
+	}
+	unsigned long mask = 1UL << mem_policy.node;
+	return (int)syscall(SYS_mbind, p, bytes, MEM_MPOL_BIND, &mask, 64, 0);
+#else
+	return -1;
+#endif
+}
+
+void* mem_alloc(size_t bytes) {
+	struct mem_header* h;
+	if (mem_policy.huge == MEM_HUGE_OFF && !mem_policy.numa) {
+		h = (struct mem_header*)malloc(bytes + MEM_HEADER_SIZE);
+		if (h == NULL) {
+			return NULL;
+		}
+		h->mapped = 0;
+		return (char*)h + MEM_HEADER_SIZE;
+	}
+
+	size_t mapped = bytes + MEM_HEADER_SIZE;
+	void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (mem_policy.huge == MEM_HUGE_TLB) {
+		size_t rounded = (mapped + MEM_HUGE_PAGE_SIZE - 1) / MEM_HUGE_PAGE_SIZE * MEM_HUGE_PAGE_SIZE;
+		p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			mapped = rounded;
+		}
+	}
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			return NULL;
+		}
+		mem_policy.tlb_fallbacks += (mem_policy.huge == MEM_HUGE_TLB);
+#ifdef MADV_HUGEPAGE
+		if (mem_policy.huge != MEM_HUGE_OFF) {
+			madvise(p, mapped, MADV_HUGEPAGE);
+		}
+#endif
+	}
+	mem_policy.maps += 1;
+
+	if (mem_policy.numa && mem_bind(p, mapped) != 0) {
+		mem_policy.bind_failures += 1;
+	}
+
+	/* First touch */
+	long page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < mapped; i += page) {
+		((volatile char*)p)[i] = 0;
+	}
+
+	h = (struct mem_header*)p;
+	h->mapped = mapped;
+	return (char*)p + MEM_HEADER_SIZE;
+}
+
+void mem_free(void* ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	struct mem_header* h = (struct mem_header*)((char*)ptr - MEM_HEADER_SIZE);
+	if (h->mapped == 0) {
+		free(h);
+	} else {
+		munmap(h, h->mapped);
+	}
+}
+
+/* Print the policy in effect for this rank, on one line */
+void mem_policy_report(int rank) {
+	printf("RANK(%d) MEMORY POLICY: pages %s", rank, mem_huge_name(mem_policy.huge));
+	if (mem_policy.tlb_fallbacks > 0) {
+		printf(" (%zu of %zu maps fell back to thp)", mem_policy.tlb_fallbacks, mem_policy.maps);
+	}
+	FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (f != NULL) {
+		char line[128];
+		if (mem_policy.huge != MEM_HUGE_OFF && fgets(line, sizeof(line), f) != NULL && strstr(line, "[never]")) {
+			printf(" (thp disabled by the kernel)");
+		}
+		fclose(f);
+	}
+	if (!mem_policy.numa) {
+		printf(", numa off");
+	} else if (mem_policy.bind_failures > 0) {
+		printf(", numa bind to node %d failed for %zu of %zu maps", mem_policy.node, mem_policy.bind_failures,
+				mem_policy.maps);
+	} else {
+		printf(", numa bound to node %d", mem_policy.node);
+	}
+	printf("\n");
+}
+
+#endif
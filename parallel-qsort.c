@@ -1,89 +1,182 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <math.h>
 #include "./serial_sort.h"
 #include "./filereader.h"
 #include "./peak_mem_check.h"
+#include "./cycle_clock.h"
+#include "./verify.h"
+#include "./hyperquicksort.h"
+#include "./hq_select.h"
+#include "./aggregate.h"
+#include "./shard_merge.h"
+#include "./partfile.h"
+#include "./thread_sort.h"
+#include "./str_sort.h"
+#include "./lsm_update.h"
 
-#ifdef CUDA_MODE
-#include "./cuda_api.h"
-#endif
+/* own process rank, total number of ranks */
+int myrank, numranks;
 
-#define CLOCKS_PER_MSEC 512000
+/* Sorted range this rank holds */
+struct hq_result result;
 
-int rc, errorlen;
-char errorStr[MPI_MAX_ERROR_STRING];
+/* Communicators and exchange buffers, shared by all jobs */
+struct hq_context ctx;
 
-/* own process rank, total number of ranks */
-int myrank, numranks;
+/* One input file to sort into one output file */
+struct sort_job {
+	/* Path to read from */
+	char* frpath;
+
+	/* Path to write to */
+	char* fwrpath;
+};
+
+/* Jobs of this launch, a single one unless --batch */
+struct sort_job* jobs;
+int numjobs;
+
+/* Manifest text the job paths point into (--batch) */
+char* manifest_text;
+
+/* Sorting a manifest of jobs (--batch) */
+int batch = 0;
+
+/* Writing (key, count) runs instead of every key (--aggregate) */
+int aggregate = 0;
+struct hq_agg_result agg_result;
+
+/* Answering selection queries instead of sorting (--select) */
+int select_mode = 0;
+
+/* Where the top-k keys of a query are written (--top-out=) */
+char* top_out = NULL;
+
+/* Merging already sorted shards instead of sorting (--merge) */
+int merge_mode = 0;
+
+/* Looking up keys in an indexed output instead of sorting (--lookup) */
+int lookup_mode = 0;
+
+/* Write the output as an indexed container, see index_file.h (--index) */
+int index_out = 0;
+
+/* Threads sorting as ranks within this process, see thread_sort.h (--threads=) */
+int nthreads = 0;
+struct ts_stats thread_stats;
+
+/* Sorting lines of text as variable-length keys, see str_sort.h (--strings) */
+int strings_mode = 0;
+
+/* Adding new keys to a partitioned output, see lsm_update.h (--update) */
+int update_mode = 0;
 
-/* Group consisting of all ranks */
-MPI_Group world_group;
+/* Largest slice over the mean slice before an update rebalances (--rebalance=) */
+double rebalance = LSM_REBALANCE;
 
-/* Store data array */
-elem* dataptr;
+/* Write one file per rank and a manifest, see partfile.h (--partitioned[=direct]) */
+int partitioned = 0;
+int direct_io = 0;
 
-/* Data Start Pointer */
-elem* data_start;
+/* Read the next job's input while sorting the current one (--prefetch) */
+int prefetch = 0;
 
-/* Data End Pointer */
-elem* data_end;
+/* Input buffers, the current job's and the prefetched one */
+struct file_prefetch inputs[2];
 
-/* Path to read from */
-char* frpath;
+/* Exchange through shared memory between ranks of a node (--shm) */
+int shm = 0;
 
-/* Path to write to */
-char* fwrpath;
+/* Pack exchanged halves, one of HQ_COMPRESS_* (--compress=) */
+int compress = HQ_COMPRESS_OFF;
+
+/* Pick the local sort backend on the first job's data (--local-sort=auto) */
+int autotune = 0;
+
+/* Parallel algorithm, one of HQ_ALGO_* (--algorithm=) */
+int algorithm = HQ_ALGO_HYPERCUBE;
+
+/* Look for already sorted input first (--presort) */
+int presort = 0;
+
+/* Page size of the data buffers, one of MEM_HUGE_* (--huge=) */
+int huge = MEM_HUGE_OFF;
+
+/* Bind the data buffers to the rank's NUMA node (--numa) */
+int numa = 0;
+
+/* Check the output is a sorted permutation of the input (--verify) */
+int verify = 0;
+struct verify_state vstate;
 
 unsigned long long start_time;
 unsigned long long end_time;
 unsigned long long duration;
 
-/*
- * 64 bit, free running clock for POWER9/AiMOS system
- *  Has 512MHz resolution.
- */
-unsigned long long aimos_clock_read(void) {
-  unsigned int tbl, tbu0, tbu1;
-  do {
-    __asm__ __volatile__("mftbu %0" : "=r"(tbu0));
-    __asm__ __volatile__("mftb %0" : "=r"(tbl));
-    __asm__ __volatile__("mftbu %0" : "=r"(tbu1));
-  } while (tbu0 != tbu1);
-  return (((unsigned long long)tbu0) << 32) | tbl;
+void usage(char* exe) {
+	fprintf(stderr, "USAGE: %s <frpath> <fwrpath> [--shm] [--compress=off|on|auto]\n", exe);
+	fprintf(stderr, "       %s --batch <manifest> [--prefetch] [--shm] [--compress=off|on|auto]\n", exe);
+	fprintf(stderr, "       common options: [--huge=off|thp|hugetlb] [--numa] [--local-sort=auto|<backend>] [--presort] [--aggregate] [--index] [--verify]\n");
+	fprintf(stderr, "                       [--partitioned[=direct]] [--threads=<power of 2>, on one rank]\n");
+	fprintf(stderr, "                       [--algorithm=hypercube|gather|samplesort|auto]\n");
+	fprintf(stderr, "       backends:");
+	for (int b = 0; b < NUM_SORT_BACKENDS; ++b) {
+		fprintf(stderr, " %s", sort_backends[b].name);
+	}
+	fprintf(stderr, "\n");
+	fprintf(stderr, "       %s --select <frpath> <query>[,<query>...] [--top-out=<path>]\n", exe);
+	fprintf(stderr, "       query: p<percentile> (p50, p99, p999 = 99.9), k<kth smallest>, top<count>\n");
+	fprintf(stderr, "       %s --merge <shard list> <fwrpath> [--verify]\n", exe);
+	fprintf(stderr, "       shard list: one sorted input file per line, # starts a comment\n");
+	fprintf(stderr, "       %s --lookup <indexed path> <key>|<lo>:<hi>[,...]\n", exe);
+	fprintf(stderr, "       %s --strings <frpath> <fwrpath> [--verify], one key per line\n", exe);
+	fprintf(stderr, "       %s --update <partitioned manifest> <frpath> [--rebalance=<ratio>] [--local-sort=<backend>] [--verify]\n", exe);
+	fprintf(stderr, "       manifest: one \"<frpath> <fwrpath>\" pair per line, # starts a comment\n");
 }
 
-/* Number of bits in a 32 bit integer
- * If bitCount(n) = 1, then n is a power of 2
- */
-int bitCount(int num);
+/* Rank 0 reads the text file path and broadcasts it into manifest_text */
+long read_text(char* path);
 
+/* Every rank splits the manifest into jobs */
+void read_manifest(char* path);
 
-/* Get the number of elements 
- * this rank currently holds
- */
-size_t numElems();
+/* Sort job j, its input is already being read into inputs[j % 2] */
+int run_job(int j);
+
+/* Answer the comma separated queries over the keys in frpath */
+int run_select(char* frpath, char* queries);
+
+/* Merge the sorted files listed in shard_list into fwrpath */
+int run_merge(char* shard_list, char* fwrpath);
 
-/* Get the median of the data set */
-elem getMedian();
+/* Answer the comma separated key and range lookups on the container fname */
+int run_lookup(char* fname, char* queries);
 
-/* Split array about a pivot value */
-void split_array(elem** l_arr, size_t* l_sz, elem** r_arr, size_t* r_sz, elem pv);
+/* Sort the lines of frpath into fwrpath */
+int run_strings(char* frpath, char* fwrpath);
+
+/* Add the keys of frpath to the partitioned output listed in manifest */
+int run_update(char* manifest, char* frpath);
 
 /**
- * Parallel Sort Algorithm
+ * Reads each job's input, sorts it across all ranks
+ * with hq_sort() and writes it to the job's output.
  */
-int main(int argc, char** argv) {	
+int main(int argc, char** argv) {
 	/* MPI Initialization */
 	MPI_Init(&argc, &argv);
 	MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
 	MPI_Comm_size(MPI_COMM_WORLD, &numranks);
-	MPI_Comm_group(MPI_COMM_WORLD, &world_group);
 
 	/* Verify that numranks is a power of 2 */
-	if (bitCount(numranks) != 1) {
+	if (hq_init(&ctx, MPI_COMM_WORLD) != MPI_SUCCESS) {
 		fprintf(stderr, "ERROR rank(%d): number of ranks = %d wasn't a power of 2, total 1 bits: %d, should be 1\n", myrank, numranks, bitCount(numranks));
 		MPI_Abort(MPI_COMM_WORLD, 0);
 		return EXIT_FAILURE;
@@ -91,432 +184,814 @@ int main(int argc, char** argv) {
 
 
 	/* Input argument validation */
-	if (argc != 3) {
+	if (argc < 3) {
 		fprintf(stderr, "ERROR rank(%d): invalid arguments\n", myrank);
-		fprintf(stderr, "USAGE: %s <frpath> <fwrpath>\n", *argv); 
+		usage(*argv);
 		MPI_Abort(MPI_COMM_WORLD, 0);
 		return EXIT_FAILURE;
 	}
 
-	/* Set fpath to read from */
-	frpath = *(argv + 1);
-
-	if (myrank == 0) {
-		start_time = aimos_clock_read(); 
-	}
-
-	MPI_Offset bytes_read = readfile(myrank, numranks, &dataptr, frpath, MPI_COMM_WORLD); 
-	MPI_Offset nSize = bytes_read/sizeof(elem);
-	data_start = dataptr;
-	data_end   = dataptr + nSize - 1;
-	
-	if (nSize == 0) {
-		fprintf(stderr, "ERROR rank(%d): More ranks than elements in the input.\n", myrank);
-
+	batch = (0 == strcmp(argv[1], "--batch"));
+	select_mode = (0 == strcmp(argv[1], "--select"));
+	merge_mode = (0 == strcmp(argv[1], "--merge"));
+	lookup_mode = (0 == strcmp(argv[1], "--lookup"));
+	strings_mode = (0 == strcmp(argv[1], "--strings"));
+	update_mode = (0 == strcmp(argv[1], "--update"));
+	if ((select_mode || merge_mode || lookup_mode || strings_mode || update_mode) && argc < 4) {
+		fprintf(stderr, "ERROR rank(%d): %s needs two arguments\n", myrank, argv[1]);
+		usage(*argv);
 		MPI_Abort(MPI_COMM_WORLD, 0);
-		exit(EXIT_FAILURE);
+		return EXIT_FAILURE;
 	}
 
-
-	/* BEGIN PARALLEL SORT */
-	MPI_Comm parent_comm = MPI_COMM_WORLD;
-	int localRank = myrank;
-	int localNumranks = numranks;
-	MPI_Barrier(MPI_COMM_WORLD);
-
-	while(localNumranks > 1) {
-
-#ifdef DEBUG_MODE
-		fprintf(stderr, "G_RANK(%d) G_NUMRANKS(%d) L_RANK(%d) L_NUMRANKS(%d)\n", myrank, numranks, localRank, localNumranks);
-#endif
-		
-		int* localHaveElems = NULL;
-		elem* localMedians = NULL;
-		
-		int ownHasElems = (numElems() > 0);
-		elem ownLocalMedian = 0;
-		if (ownHasElems) {
-			ownLocalMedian = getMedian();
-		}
-
-		if (localRank == 0) { /* LEADER */
-#ifdef DEBUG_MODE
-			fprintf(stderr, "LEADER RANK(%d) L_RANK(%d)\n", myrank, localRank);
-#endif
-			
-			localHaveElems = (int*)calloc(localNumranks, sizeof(int));
-			localMedians = (elem*)calloc(localNumranks, sizeof(elem));
-		}
-		
-		rc = MPI_Gather(&ownHasElems, 1, MPI_INT32_T, localHaveElems, 1, MPI_INT32_T, 0, parent_comm);
-		if (rc != MPI_SUCCESS) {
-			MPI_Error_string(rc, errorStr, &errorlen);
-			fprintf(stderr, "ERROR RANK(%d): MPI_Gather(HasElems) failed with error code(%d): %s\n", myrank, rc, errorStr);
-			MPI_Abort(MPI_COMM_WORLD, rc);
-		}
-
-		rc = MPI_Gather(&ownLocalMedian, 1, MPI_INT32_T, localMedians, 1, MPI_INT32_T, 0, parent_comm);
-		if (rc != MPI_SUCCESS) {
-			MPI_Error_string(rc, errorStr, &errorlen);
-			fprintf(stderr, "ERROR RANK(%d): MPI_Gather(localMedians) failed with error code(%d): %s\n", myrank, rc, errorStr);
-			MPI_Abort(MPI_COMM_WORLD, rc);
-		}
-		elem consensusMedian = 0;
-		if (localRank == 0) {
-			/* Move all medians to the beginning of the array */
-			int medianEnd = localNumranks;
-			int medianStart = 0;
-			for (; medianStart < medianEnd; medianStart += (localHaveElems[medianStart] > 0)) {
-				if (localHaveElems[medianStart] == 0) {
-					--medianEnd;
-					swap(&localHaveElems[medianEnd], &localHaveElems[medianStart]);
-					swap(&localMedians[medianEnd], &localMedians[medianStart]);
-				}
+	for (int i = (select_mode || merge_mode || lookup_mode || strings_mode || update_mode) ? 4 : 3; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "--verify")) {
+			verify = 1;
+		} else if (batch && 0 == strcmp(argv[i], "--prefetch")) {
+			prefetch = 1;
+		} else if (0 == strcmp(argv[i], "--shm")) {
+			shm = 1;
+		} else if (0 == strcmp(argv[i], "--compress=off")) {
+			compress = HQ_COMPRESS_OFF;
+		} else if (0 == strcmp(argv[i], "--compress=on")) {
+			compress = HQ_COMPRESS_ON;
+		} else if (0 == strcmp(argv[i], "--compress=auto")) {
+			compress = HQ_COMPRESS_AUTO;
+		} else if (0 == strcmp(argv[i], "--huge=off")) {
+			huge = MEM_HUGE_OFF;
+		} else if (0 == strcmp(argv[i], "--huge=thp")) {
+			huge = MEM_HUGE_THP;
+		} else if (0 == strcmp(argv[i], "--huge=hugetlb")) {
+			huge = MEM_HUGE_TLB;
+		} else if (0 == strcmp(argv[i], "--numa")) {
+			numa = 1;
+		} else if (0 == strncmp(argv[i], "--algorithm=", 12)) {
+			algorithm = -1;
+			for (int a = 0; a <= HQ_ALGO_AUTO; ++a) {
+				algorithm = 0 == strcmp(argv[i] + 12, hq_algo_names[a]) ? a : algorithm;
 			}
-
-#ifdef DEBUG_MODE
-			fprintf(stderr, "medianEnd(%d), localNumranks(%d)\n", medianEnd, localNumranks);
-#endif
-
-			consensusMedian = findKth(localMedians, localMedians + medianEnd - 1, medianEnd/2);
-#ifdef DEBUG_MODE
-			printf("RANK(%d) L_RANK(%d) MEDIANS:", myrank, localRank);
-			for (int i = 0; i < localNumranks; ++i) {
-				if (localHaveElems[i]) {
-					printf(" %d", localMedians[i]);
-				} else {
-					printf(" _");
-				}
+			if (algorithm < 0) {
+				fprintf(stderr, "ERROR rank(%d): unknown algorithm %s\n", myrank, argv[i] + 12);
+				usage(*argv);
+				MPI_Abort(MPI_COMM_WORLD, 0);
+				return EXIT_FAILURE;
 			}
-			printf("\n");
-#endif
-
-			free(localMedians);
-			free(localHaveElems);
+		} else if (select_mode && 0 == strncmp(argv[i], "--top-out=", 10)) {
+			top_out = argv[i] + 10;
+		} else if (!select_mode && 0 == strcmp(argv[i], "--aggregate")) {
+			aggregate = 1;
+		} else if (!select_mode && !merge_mode && 0 == strcmp(argv[i], "--index")) {
+			index_out = 1;
+		} else if (!select_mode && !merge_mode && 0 == strcmp(argv[i], "--partitioned")) {
+			partitioned = 1;
+		} else if (!select_mode && !merge_mode && 0 == strcmp(argv[i], "--partitioned=direct")) {
+			partitioned = 1;
+			direct_io = 1;
+		} else if (!select_mode && !merge_mode && 0 == strncmp(argv[i], "--threads=", 10)) {
+			nthreads = atoi(argv[i] + 10);
+			if (nthreads < 1 || bitCount(nthreads) != 1 || numranks != 1) {
+				fprintf(stderr, "ERROR rank(%d): --threads= needs a power of 2 and a single rank\n", myrank);
+				usage(*argv);
+				MPI_Abort(MPI_COMM_WORLD, 0);
+				return EXIT_FAILURE;
+			}
+		} else if (update_mode && 0 == strncmp(argv[i], "--rebalance=", 12)) {
+			rebalance = atof(argv[i] + 12);
+			if (rebalance < 1.0) {
+				fprintf(stderr, "ERROR rank(%d): --rebalance= needs a ratio of at least 1\n", myrank);
+				usage(*argv);
+				MPI_Abort(MPI_COMM_WORLD, 0);
+				return EXIT_FAILURE;
+			}
+		} else if (0 == strcmp(argv[i], "--presort")) {
+			presort = 1;
+		} else if (0 == strcmp(argv[i], "--local-sort=auto")) {
+			autotune = 1;
+		} else if (0 == strncmp(argv[i], "--local-sort=", 13) && sort_backend_find(argv[i] + 13) != NULL) {
+			ctx.backend = sort_backend_find(argv[i] + 13);
+		} else {
+			fprintf(stderr, "ERROR rank(%d): unknown option %s\n", myrank, argv[i]);
+			usage(*argv);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+			return EXIT_FAILURE;
 		}
+	}
 
+	if (aggregate && index_out) {
+		fprintf(stderr, "ERROR rank(%d): --index writes keys, not the runs of --aggregate\n", myrank);
+		usage(*argv);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+		return EXIT_FAILURE;
+	}
+	if (aggregate && nthreads > 0) {
+		fprintf(stderr, "ERROR rank(%d): --threads= sorts keys, it does not aggregate\n", myrank);
+		usage(*argv);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+		return EXIT_FAILURE;
+	}
+	if (strings_mode && (aggregate || index_out || partitioned || nthreads > 0)) {
+		fprintf(stderr, "ERROR rank(%d): --strings writes lines of text, without --aggregate, --index, --partitioned or --threads=\n", myrank);
+		usage(*argv);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+		return EXIT_FAILURE;
+	}
+	if (update_mode && (aggregate || index_out || partitioned || nthreads > 0)) {
+		fprintf(stderr, "ERROR rank(%d): --update adds keys to a partitioned output, without --aggregate, --index, --partitioned or --threads=\n", myrank);
+		usage(*argv);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+		return EXIT_FAILURE;
+	}
+	if (index_out && partitioned) {
+		fprintf(stderr, "ERROR rank(%d): --index and --partitioned are different output formats\n", myrank);
+		usage(*argv);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+		return EXIT_FAILURE;
+	}
 
-		rc = MPI_Bcast(&consensusMedian, 1, MPI_INT32_T, 0, parent_comm);
+	mem_policy_init(huge, numa);
+	ctx.presort = presort;
+	ctx.algorithm = algorithm;
 
-		if (rc != MPI_SUCCESS) {
-			MPI_Error_string(rc, errorStr, &errorlen);
-			fprintf(stderr, "ERROR RANK(%d): MPI_Scatter(consensusMedian) failed with error code(%d): %s\n", myrank, rc, errorStr);
-			MPI_Abort(MPI_COMM_WORLD, rc);
+	if (shm) {
+		int intra = hq_enable_shm(&ctx);
+		if (myrank == 0) {
+			printf("SHM: %d of %d levels exchange within the node\n", intra, ctx.levels);
 		}
+	}
 
-#ifdef DEBUG_MODE	
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d) CONSENSUS_MEDIAN(%d)\n", myrank, localRank, consensusMedian); 
-#endif
-
-#ifdef DEBUG_MODE
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d) SPLIT VAL(%d)\n", myrank, localRank, consensusMedian);
-#endif
-
-		elem* l_arr = NULL;
-		elem* r_arr = NULL;
-		size_t l_sz;
-		size_t r_sz;
-	
-		split_array(&l_arr, &l_sz, &r_arr, &r_sz, consensusMedian);
-
-#ifdef DEBUG_MODE		
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d): l_sz(%ld) + r_sz(%ld) = total_sz(%ld) <===> numElems(%ld)\n", myrank, localRank,
-				l_sz, r_sz, l_sz + r_sz, numElems());  
-#endif
-
-		const int color = (localRank >= (localNumranks >> 1));
-		const int key   = (localRank % (localNumranks >> 1));
-		const int tag = 123;
-		int src_rank;
-		size_t send_size;
-		elem* send_arr;
-		size_t recv_size;
-		elem* recv_arr;
-		size_t keep_size;
-		elem* keep_arr;
-
-		if (color) { /* Right side */
-			keep_size = r_sz;
-			keep_arr = r_arr;
-			send_size = l_sz;
-			send_arr = l_arr;
-			src_rank = localRank - (localNumranks >> 1);
-		} else { /* Left side */
-			keep_size = l_sz;
-			keep_arr = l_arr;
-			send_size = r_sz;
-			send_arr = r_arr;
-			src_rank = localRank + (localNumranks >> 1);
+	if (compress != HQ_COMPRESS_OFF) {
+		hq_enable_compress(&ctx, compress);
+		if (myrank == 0 && compress == HQ_COMPRESS_AUTO) {
+			printf("COMPRESS: link %.1f us %.1f MB/s, codec %.2f ns/key\n", ctx.link_latency * 1e6,
+					ctx.link_bandwidth / 1e6, ctx.codec_sec_per_key * 1e9);
 		}
+	}
 
-#ifdef DEBUG_MODE
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d) SRC(%d)\n", myrank, localRank, src_rank);
-#endif
-
-		MPI_Status status_send;
-		MPI_Status status_recv;
-		MPI_Request request_send = MPI_REQUEST_NULL;
-		MPI_Request request_recv = MPI_REQUEST_NULL;
-
-#ifdef DEBUG_MODE
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d) sending send_size(%ld) to rank(%d)\n", myrank, localRank, send_size, src_rank);
-#endif
-
-		rc = MPI_Irecv(&recv_size, 1, MPI_UINT64_T, src_rank, tag, parent_comm, &request_recv);
-		rc = MPI_Isend(&send_size, 1, MPI_UINT64_T, src_rank, tag, parent_comm, &request_send);
-
-		rc = MPI_Wait(&request_send, &status_send);
-		rc = MPI_Wait(&request_recv, &status_recv);
-
-#ifdef DEBUG_MODE
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d) received recv_size(%ld) from rank(%d)\n", myrank, localRank, recv_size, src_rank);
-#endif
-
-#ifdef DEBUG_MODE
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d): color(%d) recv_size(%ld)\n", myrank, localRank, color, recv_size);
-#endif
-
-
-
-		recv_arr = (elem*)calloc(recv_size, sizeof(elem));
+	if (batch) {
+		read_manifest(argv[2]);
+	} else if (select_mode || merge_mode || lookup_mode || strings_mode || update_mode) {
+		numjobs = 0;
+		jobs = NULL;
+	} else {
+		numjobs = 1;
+		jobs = (struct sort_job*)malloc(sizeof(struct sort_job));
+		jobs[0].frpath = argv[1];
+		jobs[0].fwrpath = argv[2];
+	}
 
-		rc = MPI_Irecv(recv_arr, recv_size, MPI_INT32_T, src_rank, tag, parent_comm, &request_recv);
-		rc = MPI_Isend(send_arr, send_size, MPI_INT32_T, src_rank, tag, parent_comm, &request_send);
+	file_prefetch_init(&inputs[0]);
+	file_prefetch_init(&inputs[1]);
 
+	if (myrank == 0) {
+		start_time = aimos_clock_read();
+	}
 
+	int verified = 1;
+	if (numjobs > 0) {
+		readfile_begin(myrank, numranks, &inputs[0], jobs[0].frpath, MPI_COMM_WORLD);
+	}
+	for (int j = 0; j < numjobs; ++j) {
+		verified &= run_job(j);
+	}
+	if (select_mode) {
+		verified = run_select(argv[2], argv[3]);
+	}
+	if (merge_mode) {
+		verified = run_merge(argv[2], argv[3]);
+	}
+	if (lookup_mode) {
+		verified = run_lookup(argv[2], argv[3]);
+	}
+	if (strings_mode) {
+		verified = run_strings(argv[2], argv[3]);
+	}
+	if (update_mode) {
+		verified = run_update(argv[2], argv[3]);
+	}
 
-		rc = MPI_Wait(&request_send, &status_send);
-		rc = MPI_Wait(&request_recv, &status_recv);
+	if (batch) {
+		MPI_Barrier(MPI_COMM_WORLD);
+		if (myrank == 0) {
+			end_time = aimos_clock_read();
+			duration = (end_time - start_time)/CLOCKS_PER_MSEC;
+			printf("TOTAL EXECUTION TIME: %llu MILLISECONDS FOR %d JOBS\n", duration, numjobs);
+			fflush(NULL);
+		}
+	}
 
+	if (compress != HQ_COMPRESS_OFF) {
+		uint64_t bytes[2] = { ctx.bytes_raw, ctx.bytes_wire };
+		uint64_t total[2];
+		MPI_Reduce(bytes, total, 2, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+		if (myrank == 0) {
+			printf("COMPRESS: sent %llu of %llu exchanged bytes (%.2fx)\n", (unsigned long long)total[1],
+					(unsigned long long)total[0], total[1] > 0 ? (double)total[0] / total[1] : 1.0);
+		}
+	}
 
+	for (int i = 0; i < numranks; ++i) {
+		if (i == myrank) {
+			mem_policy_report(myrank);
+			printf("RANK(%d) PEAK MEMORY USAGE: ", myrank);
+			fflush(NULL);
+			peak_mem_check(getpid());
+		}
+		MPI_Barrier(MPI_COMM_WORLD);
+	}
 
-		free(send_arr);
-		free(dataptr);
+	if (!batch && !select_mode && !merge_mode && !lookup_mode && !aggregate) {
+		printf("RANK(%d) FINISHED ALGORITHM numElems(%ld):", myrank, result.n);
+		if (result.n > 100) {
+			printf("Output too large, Omitting...\n");
+		} else {
+			for (size_t i = 0; i < result.n; ++i) {
+				printf(" %d", result.data[i]);
+			}
+			printf("\n");
+		}
+	}
 
+	file_prefetch_free(&inputs[0]);
+	file_prefetch_free(&inputs[1]);
+	free(jobs);
+	free(manifest_text);
+	hq_finalize(&ctx);
 
+	/* MPI Clean up */
+	MPI_Finalize();
+	return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
+int run_job(int j) {
+	struct file_prefetch* input = &inputs[j % 2];
+	unsigned long long job_start = aimos_clock_read();
 
-		elem* new_arr = calloc(keep_size + recv_size, sizeof(elem));
-		memcpy(new_arr, keep_arr, keep_size * sizeof(elem));
-		memcpy(new_arr + keep_size, recv_arr, recv_size * sizeof(elem));
+	MPI_Offset bytes_read = readfile_end(myrank, input);
+	MPI_Offset nSize = bytes_read/sizeof(elem);
+	elem* dataptr = input->buf;
 
-#ifdef DEBUG_MODE		
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d) FINISHED EXCHANGING\n", myrank, localRank);
+	/* The other buffer's job was written out, it can take the next input */
+	if (j + 1 < numjobs && prefetch) {
+		readfile_begin(myrank, numranks, &inputs[(j + 1) % 2], jobs[j + 1].frpath, MPI_COMM_WORLD);
+	}
+	unsigned long long read_time = aimos_clock_read() - job_start;
 
-		fprintf(stderr, "G_RANK(%d) L_RANK(%d) KEEP_SIZE(%ld)", myrank, localRank, keep_size);
-		printf("G_RANK(%d) keep_data:", myrank);
-		for (int i = 0; i < keep_size; ++i) {
-			printf(" %d", keep_arr[i]);
-		}
-		printf("\nG_RANK(%d) recv_data:", myrank);
-		for (int i = 0; i < recv_size; ++i) {
-			printf(" %d", recv_arr[i]);
-		}
-		printf("\nG_RANK(%d) final_data:", myrank);
-		for (int i = 0; i < recv_size + keep_size; ++i) {
-			printf(" %d", new_arr[i]);
-		}
+	/* Ranks without keys hand verify.h the empty range [none + 1, none] */
+	elem none[2] = { 0, 0 };
+	if (verify) {
+		verify_before(&vstate, nSize > 0 ? dataptr : &none[1], nSize > 0 ? dataptr + nSize - 1 : &none[0]);
+	}
 
-		printf("\n");
-#endif	
-		free(recv_arr);
-		free(keep_arr);
-		dataptr = new_arr;
-		data_start = new_arr;
-		data_end = new_arr + recv_size + keep_size - 1;
-		
+	/* A container flagged sorted is checked for the no-op path first */
+	ctx.presort = presort || (input->flags & INDEX_SORTED);
 
-		MPI_Barrier(parent_comm);
-		rc = MPI_Comm_split(parent_comm, color, key, &parent_comm);
-		if (rc != MPI_SUCCESS) {
-			MPI_Error_string(rc, errorStr, &errorlen);
-			fprintf(stderr, "ERROR RANK(%d): MPI_Comm_split() failed with error code(%d): %s\n", myrank, rc, errorStr);
-			MPI_Abort(MPI_COMM_WORLD, rc);
-		}
-		
-		rc = MPI_Comm_rank(parent_comm, &localRank);
-		if (rc != MPI_SUCCESS) {
-			MPI_Error_string(rc, errorStr, &errorlen);
-			fprintf(stderr, "ERROR RANK(%d): MPI_Comm_rank() failed with error code(%d): %s\n", myrank, rc, errorStr);
-			MPI_Abort(MPI_COMM_WORLD, rc);
+	if (autotune && j == 0) {
+		struct sort_backend_timing times[NUM_SORT_BACKENDS];
+		ctx.backend = sort_backend_autotune(dataptr, nSize, MPI_COMM_WORLD, times);
+		if (myrank == 0) {
+			printf("LOCAL SORT: %s, calibration on all ranks:", ctx.backend->name);
+			for (int b = 0; b < NUM_SORT_BACKENDS; ++b) {
+				printf(" %s %.3f ms/%zu keys", sort_backends[b].name, times[b].seconds * 1e3, times[b].keys);
+			}
+			printf("\n");
 		}
+	}
 
-		rc = MPI_Comm_size(parent_comm, &localNumranks);
-		if (rc != MPI_SUCCESS) {
-			MPI_Error_string(rc, errorStr, &errorlen);
-			fprintf(stderr, "ERROR RANK(%d): MPI_Comm_size() failed with error code(%d): %s\n", myrank, rc, errorStr);
-			MPI_Abort(MPI_COMM_WORLD, rc);
+	/* Cost model constants, measured outside of the timed sort */
+	if (algorithm == HQ_ALGO_AUTO && j == 0) {
+		hq_calibrate(&ctx);
+		if (myrank == 0) {
+			printf("COST MODEL: link %.1f us %.1f MB/s, sort %.3f ns/key/log2(keys)\n", ctx.link_latency * 1e6,
+					ctx.link_bandwidth / 1e6, ctx.sort_sec_per_key * 1e9);
 		}
+	}
 
+	/* BEGIN PARALLEL SORT */
+	MPI_Barrier(MPI_COMM_WORLD);
+	unsigned long long sort_start = aimos_clock_read();
 
+	if (myrank == 0 && !batch) {
+		fprintf(stderr, "RANK 0: Doing %s Sort\n", ctx.backend->name);
 	}
-#ifdef CUDA_MODE
-	if (myrank == 0) {
-		fprintf(stderr, "RANK 0: Doing Cuda Sort\n");
-	}
-	CU_Init();
-	CU_OddEvenNetworkSort(data_start, data_end);
-#else
-	if (myrank == 0) {
-		fprintf(stderr, "RANK 0: Doing CPU Sort\n");
-	}
-	m_qsort(data_start, data_end);
-#endif
 
+	if (aggregate) {
+		hq_aggregate(&ctx, dataptr, nSize, &agg_result);
+	} else if (nthreads > 0) {
+		result.data = hq_buffer(&ctx, 0, nSize);
+		result.n = nSize;
+		result.offset = 0;
+		ts_sort(dataptr, nSize, nthreads, ctx.backend, result.data, &thread_stats);
+	} else {
+		hq_sort(&ctx, dataptr, nSize, &result);
+	}
 
 	MPI_Barrier(MPI_COMM_WORLD);
 	/* END PARALLEL SORT */
+	unsigned long long sort_time = aimos_clock_read() - sort_start;
+
+	if (myrank == 0 && algorithm != HQ_ALGO_HYPERCUBE) {
+		printf("ALGORITHM: %s, SORT %llu MILLISECONDS", hq_algo_names[ctx.last_algorithm], sort_time/CLOCKS_PER_MSEC);
+		if (algorithm == HQ_ALGO_AUTO) {
+			printf(", predicted:");
+			for (int a = 0; a < HQ_NUM_ALGOS; ++a) {
+				printf(" %s %.3f ms", hq_algo_names[a], ctx.predicted[a] * 1e3);
+			}
+		}
+		printf("\n");
+	}
 
-	size_t out_size = numElems() * sizeof(elem);
-
-	size_t* fsums = NULL;
+	if (nthreads > 0 && myrank == 0) {
+		printf("THREADS: %d, split %.3f ms holding up to %d ranges, copy and sort %.3f ms, %llu bytes copied\n", nthreads,
+				thread_stats.split_sec * 1e3, thread_stats.max_ranges, thread_stats.sort_sec * 1e3,
+				(unsigned long long)thread_stats.copied * sizeof(elem));
+	}
 
-	if (myrank == 0) {
-		fsums = calloc(numElems() + 1, sizeof(size_t));
-		if (fsums == NULL) {
-			fprintf(stderr, "ERROR RANK(%d): calloc() failed\n", myrank);
-			MPI_Abort(MPI_COMM_WORLD, 0);
+	if (aggregate) {
+		uint64_t own[3] = { nSize, agg_result.n, agg_result.sent };
+		uint64_t total[3];
+		MPI_Reduce(own, total, 3, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+		if (myrank == 0) {
+			printf("AGGREGATE: %llu keys in %llu runs, %llu runs exchanged\n", (unsigned long long)total[0],
+					(unsigned long long)total[1], (unsigned long long)total[2]);
 		}
 	}
 
-	rc = MPI_Gather(&out_size, 1, MPI_UINT64_T, fsums + 1, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
-	if (rc != MPI_SUCCESS) {
-		MPI_Error_string(rc, errorStr, &errorlen);
-		fprintf(stderr, "ERROR RANK(%d): MPI_Gather() failed with error code(%d): %s\n", myrank, rc, errorStr);
-		MPI_Abort(MPI_COMM_WORLD, rc);
+	if (ctx.presort && myrank == 0 && !aggregate) {
+		struct presort_stats* ps = &ctx.presort_stats;
+		printf("PRESORT: %s, %llu descents on %llu ranks, %d rounds moved %llu keys\n", presort_path_name(ps->path),
+				(unsigned long long)ps->descents, (unsigned long long)ps->unsorted_ranks, ps->rounds,
+				(unsigned long long)ps->moved);
 	}
-	if (myrank == 0) {	
-		for (int i = 1; i <= numranks; ++i) {
-			fsums[i] += fsums[i - 1];
+
+	int verified = 1;
+	if (verify) {
+		unsigned long long verify_start = aimos_clock_read();
+		if (aggregate && agg_result.n > 0) {
+			const elem* first = &agg_result.runs[0].key;
+			verify_after_runs(&vstate, first, &agg_result.runs[0].count, agg_result.n, AGG_RUN_ELEMS);
+			verified = verify_finish(&vstate, first, first + (agg_result.n - 1) * AGG_RUN_ELEMS, MPI_COMM_WORLD);
+		} else if (!aggregate && result.n > 0) {
+			verify_after(&vstate, result.data, result.data + result.n - 1);
+			verified = verify_finish(&vstate, result.data, result.data + result.n - 1, MPI_COMM_WORLD);
+		} else {
+			verified = verify_finish(&vstate, &none[1], &none[0], MPI_COMM_WORLD);
+		}
+		if (myrank == 0) {
+			printf("VERIFY: %s in %llu MILLISECONDS\n", verified ? "PASSED" : "FAILED",
+					(aimos_clock_read() - verify_start)/CLOCKS_PER_MSEC);
 		}
 	}
 
-	size_t writeAt;
-	rc = MPI_Scatter(fsums, 1, MPI_UINT64_T, &writeAt, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+	const elem* out_data = result.data;
+	size_t out_size = result.n * sizeof(elem);
+	size_t writeAt = result.offset * sizeof(elem);
+	if (aggregate) {
+		out_data = (const elem*)agg_result.runs;
+		out_size = agg_result.n * sizeof(struct agg_run);
+		writeAt = agg_result.offset * sizeof(struct agg_run);
+	}
 
+	if (!batch) {
+		fprintf(stderr, "RANK(%d) writing (%ld) bytes at offset (%ld)\n", myrank, out_size, writeAt);
 
-	if (rc != MPI_SUCCESS) {
-		MPI_Error_string(rc, errorStr, &errorlen);
-		fprintf(stderr, "ERROR RANK(%d): MPI_Scatter() failed with error code(%d): %s\n", myrank, rc, errorStr);
-		MPI_Abort(MPI_COMM_WORLD, rc);
-	}
-	
-	free(fsums);
-	
-	fprintf(stderr, "RANK(%d) writing (%ld) bytes at offset (%ld)\n", myrank, out_size, writeAt);
+		MPI_Barrier(MPI_COMM_WORLD);
 
-	MPI_Barrier(MPI_COMM_WORLD);
-	
-	if (myrank == 0) {
-		end_time = aimos_clock_read();
-		duration = (end_time - start_time)/CLOCKS_PER_MSEC;
-		printf("TOTAL EXECUTION TIME: %llu MILLISECONDS\n", duration);
-		fflush(NULL);
-	}
-	
-	for (int i = 0; i < numranks; ++i) {
-		if (i == myrank) {
-			printf("RANK(%d) PEAK MEMORY USAGE: ", myrank);
+		if (myrank == 0) {
+			end_time = aimos_clock_read();
+			duration = (end_time - start_time)/CLOCKS_PER_MSEC;
+			printf("TOTAL EXECUTION TIME: %llu MILLISECONDS\n", duration);
 			fflush(NULL);
-			peak_mem_check(getpid()); 
 		}
-		MPI_Barrier(MPI_COMM_WORLD);
 	}
 
-	printf("RANK(%d) FINISHED ALGORITHM numElems(%ld):", myrank, numElems());
-	if (numElems() > 100) {
-		printf("Output too large, Omitting...\n");
-	} else {
-		for (elem* it = data_start; it <= data_end; ++it) {
-			printf(" %d", *it);
+	unsigned long long write_start = aimos_clock_read();
+	int direct_ranks = 0;
+	if (index_out) {
+		index_write(result.data, result.n, result.offset, verified ? INDEX_SORTED : 0, jobs[j].fwrpath, MPI_COMM_WORLD);
+	} else if (partitioned) {
+		/* Keys of the slice are the first and last record's, runs start with theirs as well */
+		size_t record = aggregate ? sizeof(struct agg_run) : sizeof(elem);
+		struct part_entry own = { out_size / record, writeAt / record, 0, 0 };
+		if (own.records > 0) {
+			own.min = out_data[0];
+			own.max = *(const elem*)((const char*)out_data + out_size - record);
 		}
-		printf("\n");
+		direct_ranks = part_write_all(out_data, out_size, &own, jobs[j].fwrpath, direct_io, MPI_COMM_WORLD);
+	} else {
+		writefile(myrank, numranks, writeAt, out_size, out_data, jobs[j].fwrpath, MPI_COMM_WORLD);
 	}
+	MPI_Barrier(MPI_COMM_WORLD);
+	unsigned long long write_time = aimos_clock_read() - write_start;
 
+	if (myrank == 0) {
+		if (batch) {
+			printf("JOB(%d) %s -> %s: READ WAIT %llu SORT %llu WRITE %llu MILLISECONDS\n", j, jobs[j].frpath, jobs[j].fwrpath,
+					read_time/CLOCKS_PER_MSEC, sort_time/CLOCKS_PER_MSEC, write_time/CLOCKS_PER_MSEC);
+		} else {
+			printf("WRITE TIME: %llu MILLISECONDS\n", write_time/CLOCKS_PER_MSEC);
+		}
+		if (partitioned) {
+			printf("PARTITIONED: %d files listed in %s, %d written with O_DIRECT\n", numranks, jobs[j].fwrpath,
+					direct_ranks);
+		}
+		fflush(NULL);
+	}
 
-
-	free(dataptr);
-
-	/* MPI Clean up */
-	MPI_Finalize();
-	return EXIT_SUCCESS;
+	/* Without prefetching the next read starts once this job is done */
+	if (j + 1 < numjobs && !prefetch) {
+		readfile_begin(myrank, numranks, &inputs[(j + 1) % 2], jobs[j + 1].frpath, MPI_COMM_WORLD);
+	}
+	return verified;
 }
 
+long read_text(char* path) {
+	long len = 0;
+	if (myrank == 0) {
+		FILE* f = fopen(path, "r");
+		if (f == NULL) {
+			perror("ERROR: fopen(manifest) failed");
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		manifest_text = (char*)malloc(len + 1);
+		if (fread(manifest_text, 1, len, f) != (size_t)len) {
+			perror("ERROR: fread(manifest) failed");
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		fclose(f);
+	}
 
-int bitCount(int num) {
-	__int32_t bit = 1;
-	int ans = 0;
-	for (int i = 0; i < sizeof(num) * 4; ++i, bit <<= 1) {
-		ans += ((bit & num) != 0);
+	hq_check(MPI_Bcast(&len, 1, MPI_LONG, 0, MPI_COMM_WORLD), "MPI_Bcast(manifest length)", myrank);
+	if (myrank != 0) {
+		manifest_text = (char*)malloc(len + 1);
 	}
-	return ans;
+	hq_check(MPI_Bcast(manifest_text, len, MPI_CHAR, 0, MPI_COMM_WORLD), "MPI_Bcast(manifest)", myrank);
+	manifest_text[len] = '\0';
+	return len;
 }
 
+void read_manifest(char* path) {
+	long len = read_text(path);
 
-
-
-size_t numElems() {
-	return (data_end - data_start + 1);
-}
-
-elem getMedian() {
-	return findKth(data_start, data_end, numElems()/2);
+	/* Every line holds at most one job */
+	int lines = 1;
+	for (long i = 0; i < len; ++i) {
+		lines += (manifest_text[i] == '\n');
+	}
+	jobs = (struct sort_job*)malloc(lines * sizeof(struct sort_job));
+	numjobs = 0;
+
+	char* save_line;
+	for (char* line = strtok_r(manifest_text, "\n", &save_line); line != NULL; line = strtok_r(NULL, "\n", &save_line)) {
+		char* hash = strchr(line, '#');
+		if (hash != NULL) {
+			*hash = '\0';
+		}
+		char* save_tok;
+		char* in = strtok_r(line, " \t\r", &save_tok);
+		char* out = strtok_r(NULL, " \t\r", &save_tok);
+		if (in == NULL) {
+			continue;
+		}
+		if (out == NULL || strtok_r(NULL, " \t\r", &save_tok) != NULL) {
+			if (myrank == 0) {
+				fprintf(stderr, "ERROR: manifest line \"%s\" is not \"<frpath> <fwrpath>\"\n", in);
+			}
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		jobs[numjobs].frpath = in;
+		jobs[numjobs].fwrpath = out;
+		++numjobs;
+	}
 }
 
-
-
-void split_array(elem** l_arr, size_t* l_sz, elem** r_arr, size_t* r_sz, elem pv) {
-	size_t ls = 0;
-	size_t rs = 0;
-	
-	for (elem* it = data_start; it <= data_end; ++it) {
-		if (cmp(it, &pv) == 1) {
-			++rs;
-		} else {
-			++ls;
-		}
+/* k of a query, 0 if it is not valid; top is set for top<count> */
+uint64_t query_k(const char* q, uint64_t total, int* top) {
+	char* end;
+	*top = 0;
+	if (0 == strncmp(q, "top", 3)) {
+		*top = 1;
+		uint64_t k = strtoull(q + 3, &end, 10);
+		return (*end == '\0' && k <= total && k <= INT_MAX) ? k : 0;
 	}
-	
-	*l_arr = calloc(ls, sizeof(elem));
-	*r_arr = calloc(rs, sizeof(elem));
-	elem* l_put = *l_arr;
-	elem* r_put = *r_arr;
-	for (elem* it = data_start; it <= data_end; ++it) {
-		if (cmp(it, &pv) == 1) {
-			*(r_put++) = *it;
-		} else {
-			*(l_put++) = *it;
+	if (q[0] == 'k') {
+		uint64_t k = strtoull(q + 1, &end, 10);
+		return (*end == '\0' && k <= total) ? k : 0;
+	}
+	if (q[0] == 'p') {
+		/* p999 is 99.9, p99.9 as well, p100 is 100 */
+		char digits[64];
+		const char* num = q + 1;
+		if (strchr(num, '.') == NULL && strlen(num) > 2 && strcmp(num, "100") != 0 && strlen(num) < sizeof(digits) - 1) {
+			snprintf(digits, sizeof(digits), "%.2s.%s", num, num + 2);
+			num = digits;
+		}
+		double pct = strtod(num, &end);
+		if (*end != '\0' || pct <= 0 || pct > 100) {
+			return 0;
 		}
+		uint64_t k = (uint64_t)ceil(pct / 100.0 * total);
+		return k < 1 ? 1 : (k > total ? total : k);
 	}
-
-	*l_sz = ls;
-	*r_sz = rs;
-
+	return 0;
 }
 
+int run_select(char* frpath, char* queries) {
+	readfile_begin(myrank, numranks, &inputs[0], frpath, MPI_COMM_WORLD);
+	MPI_Offset bytes_read = readfile_end(myrank, &inputs[0]);
+	size_t nSize = bytes_read/sizeof(elem);
+	elem* dataptr = inputs[0].buf;
+	uint64_t total = hq_count(&ctx, nSize);
+	int ok = 1;
+
+	char* save;
+	for (char* q = strtok_r(queries, ",", &save); q != NULL; q = strtok_r(NULL, ",", &save)) {
+		int top;
+		uint64_t k = query_k(q, total, &top);
+		if (k == 0) {
+			if (myrank == 0) {
+				fprintf(stderr, "ERROR: invalid query %s for %llu keys\n", q, (unsigned long long)total);
+			}
+			ok = 0;
+			continue;
+		}
 
+		MPI_Barrier(MPI_COMM_WORLD);
+		unsigned long long query_start = aimos_clock_read();
+
+		if (top) {
+			elem* out = myrank == 0 ? (elem*)malloc(k * sizeof(elem)) : NULL;
+			hq_top_k(&ctx, dataptr, nSize, k, out);
+			unsigned long long query_time = aimos_clock_read() - query_start;
+			if (myrank == 0) {
+				printf("SELECT %s: %llu keys from %d down to %d in %llu MILLISECONDS\n", q, (unsigned long long)k,
+						out[0], out[k - 1], query_time/CLOCKS_PER_MSEC);
+				if (k <= 100) {
+					for (uint64_t i = 0; i < k; ++i) {
+						printf(" %d", out[i]);
+					}
+					printf("\n");
+				}
+			}
+			if (top_out != NULL) {
+				writefile(myrank, numranks, 0, myrank == 0 ? k * sizeof(elem) : 0, out, top_out, MPI_COMM_WORLD);
+			}
+			free(out);
+			continue;
+		}
 
+		int rounds;
+		elem v = hq_select(&ctx, dataptr, nSize, k, &rounds);
+		unsigned long long query_time = aimos_clock_read() - query_start;
 
+		if (verify) {
+			/* v is the kth smallest iff fewer than k keys are below it and at least k are not above */
+			uint64_t own[2] = { 0, 0 };
+			for (size_t i = 0; i < nSize; ++i) {
+				own[0] += (dataptr[i] < v);
+				own[1] += (dataptr[i] <= v);
+			}
+			uint64_t cnt[2];
+			MPI_Allreduce(own, cnt, 2, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+			ok &= (cnt[0] < k && cnt[1] >= k);
+			if (myrank == 0 && !(cnt[0] < k && cnt[1] >= k)) {
+				fprintf(stderr, "VERIFY: FAILED, %d has %llu keys below and %llu at or below it, k = %llu\n", v,
+						(unsigned long long)cnt[0], (unsigned long long)cnt[1], (unsigned long long)k);
+			}
+		}
+		if (myrank == 0) {
+			printf("SELECT %s (k = %llu of %llu): %d in %llu MILLISECONDS, %d rounds\n", q, (unsigned long long)k,
+					(unsigned long long)total, v, query_time/CLOCKS_PER_MSEC, rounds);
+		}
+	}
+	return ok;
+}
 
+int run_merge(char* shard_list, char* fwrpath) {
+	long len = read_text(shard_list);
 
+	/* Every line names at most one shard */
+	int lines = 1;
+	for (long i = 0; i < len; ++i) {
+		lines += (manifest_text[i] == '\n');
+	}
+	char** paths = (char**)malloc(lines * sizeof(char*));
+	int nshards = 0;
+
+	char* save_line;
+	for (char* line = strtok_r(manifest_text, "\n", &save_line); line != NULL; line = strtok_r(NULL, "\n", &save_line)) {
+		char* hash = strchr(line, '#');
+		if (hash != NULL) {
+			*hash = '\0';
+		}
+		char* save_tok;
+		char* path = strtok_r(line, " \t\r", &save_tok);
+		if (path != NULL) {
+			paths[nshards++] = path;
+		}
+	}
+	if (nshards == 0) {
+		if (myrank == 0) {
+			fprintf(stderr, "ERROR: no shards in %s\n", shard_list);
+		}
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
 
+	MPI_Barrier(MPI_COMM_WORLD);
+	unsigned long long merge_start = aimos_clock_read();
 
+	struct shard_set ss;
+	struct shard_merge_stats stats;
+	elem ends[2];
+	shard_open(&ss, paths, nshards, MPI_COMM_WORLD);
+	shard_merge(&ss, fwrpath, &stats, verify ? &vstate : NULL, ends);
+	shard_close(&ss);
 
+	MPI_Barrier(MPI_COMM_WORLD);
+	unsigned long long merge_time = aimos_clock_read() - merge_start;
+
+	/* Sums of the counts, maxima of the phase times */
+	uint64_t own[4] = { stats.keys, stats.search_reads, stats.block_reads, stats.descents };
+	uint64_t total[4];
+	double own_sec[2] = { stats.corank_sec, stats.merge_sec };
+	double max_sec[2];
+	MPI_Reduce(own, total, 4, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(own_sec, max_sec, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+	if (myrank == 0) {
+		printf("MERGE: %d shards, %llu keys, co-ranking %llu block reads in %.3f ms, merge %llu block reads in %.3f ms\n",
+				nshards, (unsigned long long)total[0], (unsigned long long)total[1], max_sec[0] * 1e3,
+				(unsigned long long)total[2], max_sec[1] * 1e3);
+		if (total[3] > 0) {
+			fprintf(stderr, "WARNING: %llu keys of the shards are out of order, the shards must be sorted\n",
+					(unsigned long long)total[3]);
+		}
+		printf("TOTAL EXECUTION TIME: %llu MILLISECONDS\n", merge_time/CLOCKS_PER_MSEC);
+	}
 
+	int verified = 1;
+	if (verify) {
+		unsigned long long verify_start = aimos_clock_read();
+		const elem* l = stats.keys > 0 ? &ends[0] : &ends[1];
+		const elem* r = stats.keys > 0 ? &ends[1] : &ends[0];
+		verified = verify_finish(&vstate, l, r, MPI_COMM_WORLD);
+		if (myrank == 0) {
+			printf("VERIFY: %s in %llu MILLISECONDS\n", verified ? "PASSED" : "FAILED",
+					(aimos_clock_read() - verify_start)/CLOCKS_PER_MSEC);
+		}
+	}
+	free(paths);
+	return verified;
+}
 
+int run_lookup(char* fname, char* queries) {
+	int ok = 1;
+	if (myrank == 0) {
+		struct index_file f;
+		if (index_open(&f, fname) != 0) {
+			fprintf(stderr, "ERROR: %s is not a sorted container, write it with --index\n", fname);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		printf("LOOKUP: %llu keys in %llu blocks of %u keys\n", (unsigned long long)f.h.count,
+				(unsigned long long)f.nblocks, f.h.block_keys);
+
+		char* save;
+		for (char* q = strtok_r(queries, ",", &save); q != NULL; q = strtok_r(NULL, ",", &save)) {
+			/* <key> or <lo>:<hi>, both ends included */
+			char* end;
+			long lo = strtol(q, &end, 10);
+			long hi = lo;
+			if (*end == ':') {
+				hi = strtol(end + 1, &end, 10);
+			}
+			if (end == q || *end != '\0' || lo < INT_MIN || hi > INT_MAX || lo > hi) {
+				fprintf(stderr, "ERROR: invalid lookup %s\n", q);
+				ok = 0;
+				continue;
+			}
 
+			uint64_t reads = f.block_reads;
+			unsigned long long lookup_start = aimos_clock_read();
+			uint64_t from = index_bound(&f, (elem)lo, 0);
+			uint64_t to = index_bound(&f, (elem)hi, 1);
+			unsigned long long lookup_time = aimos_clock_read() - lookup_start;
+			printf("LOOKUP %s: %llu keys at [%llu, %llu), %llu block reads in %llu MICROSECONDS\n", q,
+					(unsigned long long)(to - from), (unsigned long long)from, (unsigned long long)to,
+					(unsigned long long)(f.block_reads - reads), lookup_time * 1000 / CLOCKS_PER_MSEC);
+		}
+		index_close(&f);
+	}
+	MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	return ok;
+}
 
+int run_strings(char* frpath, char* fwrpath) {
+	struct str_set set = { NULL, 0, NULL, 0 };
+	str_read(&ctx, frpath, &set);
+	if (verify) {
+		multiset_hash_init(&vstate.before);
+		str_hash_set(&set, &vstate.before);
+	}
 
+	MPI_Barrier(MPI_COMM_WORLD);
+	unsigned long long sort_start = aimos_clock_read();
+	struct str_stats stats;
+	str_sort(&ctx, &set, &stats);
+	MPI_Barrier(MPI_COMM_WORLD);
+	unsigned long long sort_time = aimos_clock_read() - sort_start;
 
+	/* Back to lines of text */
+	size_t outbytes = set.bytes + set.n;
+	char* out = (char*)malloc(outbytes + 1);
+	if (out == NULL) {
+		fprintf(stderr, "ERROR rank(%d): malloc() failed\n", myrank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	char* at = out;
+	for (size_t i = 0; i < set.n; ++i) {
+		memcpy(at, set.arena + set.refs[i].off, set.refs[i].len);
+		at += set.refs[i].len;
+		*at++ = '\n';
+	}
+	writefile(myrank, numranks, stats.offset, outbytes, (const elem*)out, fwrpath, MPI_COMM_WORLD);
+	free(out);
 
+	uint64_t own[5] = { set.n, set.bytes, stats.sent_keys, stats.sent_bytes, stats.messages };
+	uint64_t total[5];
+	MPI_Reduce(own, total, 5, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	if (myrank == 0) {
+		printf("STRINGS: %llu keys of %llu bytes, exchanged %llu keys in %llu packed bytes over %llu messages\n",
+				(unsigned long long)total[0], (unsigned long long)total[1], (unsigned long long)total[2],
+				(unsigned long long)total[3], (unsigned long long)total[4]);
+		printf("TOTAL EXECUTION TIME: %llu MILLISECONDS\n", sort_time/CLOCKS_PER_MSEC);
+	}
 
+	int verified = 1;
+	if (verify) {
+		unsigned long long verify_start = aimos_clock_read();
+		verified = str_verify(&ctx, &set, &vstate);
+		if (myrank == 0) {
+			printf("VERIFY: %s in %llu MILLISECONDS\n", verified ? "PASSED" : "FAILED",
+					(aimos_clock_read() - verify_start)/CLOCKS_PER_MSEC);
+		}
+	}
+	str_free(&set);
+	return verified;
+}
 
+int run_update(char* manifest, char* frpath) {
+	read_text(manifest);
+	struct lsm_state st;
+	lsm_parse(&st, manifest_text, manifest, MPI_COMM_WORLD);
+
+	readfile_begin(myrank, numranks, &inputs[0], frpath, MPI_COMM_WORLD);
+	size_t n = readfile_end(myrank, &inputs[0]) / sizeof(elem);
+	elem* delta = inputs[0].buf;
+	if (verify) {
+		multiset_hash_init(&vstate.before);
+		multiset_hash_init(&vstate.after);
+		vstate.unsorted = 0;
+		for (size_t i = 0; i < n; ++i) {
+			multiset_hash_add(&vstate.before, delta[i]);
+		}
+	}
 
+	MPI_Barrier(MPI_COMM_WORLD);
+	unsigned long long update_start = aimos_clock_read();
+	struct lsm_stats stats;
+	if (lsm_update(&ctx, &st, delta, n, rebalance, manifest, verify ? &vstate : NULL, &stats) != 0) {
+		/* Every rank failed together, the manifest still lists the previous state */
+		exit(EXIT_FAILURE);
+	}
+	lsm_commit(&st, manifest, MPI_COMM_WORLD);
+	MPI_Barrier(MPI_COMM_WORLD);
+	unsigned long long update_time = aimos_clock_read() - update_start;
+
+	/* Sums of the counts, the most runs of a rank */
+	uint64_t own[4] = { stats.ingested, stats.routed, stats.merged, stats.written };
+	uint64_t total[4];
+	int max_runs = 0;
+	MPI_Reduce(own, total, 4, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Reduce(&stats.runs, &max_runs, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+	if (myrank == 0) {
+		printf("UPDATE: generation %llu, %llu new keys, %llu routed to other ranks, %llu existing keys merged, %llu written, at most %d runs per rank\n",
+				(unsigned long long)st.generation, (unsigned long long)total[0], (unsigned long long)total[1],
+				(unsigned long long)total[2], (unsigned long long)total[3], max_runs);
+		printf("UPDATE: largest slice %.2fx the mean, %s\n", stats.imbalance,
+				stats.rebalanced ? "rebalanced" : "splitters kept");
+		printf("TOTAL EXECUTION TIME: %llu MILLISECONDS\n", update_time/CLOCKS_PER_MSEC);
+	}
 
-
-
-
-
-
-
-
+	int verified = 1;
+	if (verify) {
+		unsigned long long verify_start = aimos_clock_read();
+		verified = verify_combine(&vstate, MPI_COMM_WORLD);
+		if (myrank == 0) {
+			printf("VERIFY: %s in %llu MILLISECONDS\n", verified ? "PASSED" : "FAILED",
+					(aimos_clock_read() - verify_start)/CLOCKS_PER_MSEC);
+		}
+	}
+	lsm_free(&st);
+	return verified;
+}
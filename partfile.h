@@ -0,0 +1,206 @@
+/* Range-partitioned output: one file per rank and a manifest.
+ *
+ * Instead of every rank writing into one shared file,
+ * part_write_all() has every rank write its sorted
+ * slice to its own file <fwrpath>.<rank> with plain
+ * sequential write() calls, so there are no locks or
+ * stripes to share and nothing to coordinate. Rank 0
+ * then writes the manifest <fwrpath>, one line per
+ * rank:
+ *
+ *   <path> <records> <first index> <min key> <max key> <rank>
+ *
+ * from the global offset scan, with "-" as the keys of
+ * an empty slice. The first column is a shard list,
+ * so the manifest can be passed to --merge as is.
+ *
+ * With direct set, the files are opened with O_DIRECT
+ * and written from an aligned staging buffer in chunks
+ * of PART_DIRECT_CHUNK bytes, the last one padded to a
+ * PART_ALIGN boundary and the file cut back to size
+ * after. Where O_DIRECT is refused (tmpfs, some
+ * network file systems) the write falls back to
+ * buffered I/O.
+ *
+ * Needs _GNU_SOURCE for O_DIRECT.
+ */
+
+#ifndef PARTFILE_H
+#define PARTFILE_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "serial_sort.h"
+
+/* Alignment O_DIRECT needs for buffers, offsets and sizes */
+#define PART_ALIGN 4096
+
+/* Bytes of one O_DIRECT write */
+#define PART_DIRECT_CHUNK (8 << 20)
+
+/* Longest path of a rank's file */
+#define PART_PATH_MAX 4096
+
+/* One rank's slice, as listed in the manifest */
+struct part_entry {
+	uint64_t records;
+	uint64_t first;
+	int64_t min;
+	int64_t max;
+};
+
+#define PART_ENTRY_WORDS (sizeof(struct part_entry) / sizeof(uint64_t))
+
+/* Write all bytes of buf to fd, returns 0 or -1 with errno set */
+int part_write_fd(int fd, const char* buf, size_t bytes) {
+	while (bytes > 0) {
+		ssize_t done = write(fd, buf, bytes);
+		if (done < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += done;
+		bytes -= done;
+	}
+	return 0;
+}
+
+/* Write data[0, bytes) to path through an aligned buffer with O_DIRECT.
+ * Returns 0, 1 if O_DIRECT was refused before anything was written,
+ * or -1 with errno set.
+ */
+int part_write_direct(const char* path, const void* data, size_t bytes) {
+#ifdef O_DIRECT
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (fd < 0) {
+		return errno == EINVAL ? 1 : -1;
+	}
+	void* stage;
+	if (posix_memalign(&stage, PART_ALIGN, PART_DIRECT_CHUNK) != 0) {
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	int rc = 0;
+	for (size_t done = 0; done < bytes && rc == 0; done += PART_DIRECT_CHUNK) {
+		size_t chunk = bytes - done < PART_DIRECT_CHUNK ? bytes - done : PART_DIRECT_CHUNK;
+		size_t padded = (chunk + PART_ALIGN - 1) / PART_ALIGN * PART_ALIGN;
+		memcpy(stage, (const char*)data + done, chunk);
+		memset((char*)stage + chunk, 0, padded - chunk);
+		rc = part_write_fd(fd, (const char*)stage, padded);
+		if (rc != 0 && done == 0 && errno == EINVAL) {
+			free(stage);
+			close(fd);
+			return 1;
+		}
+	}
+	free(stage);
+	if (rc == 0) {
+		rc = ftruncate(fd, bytes);
+	}
+	if (close(fd) != 0) {
+		rc = -1;
+	}
+	return rc;
+#else
+	return 1;
+#endif
+}
+
+/* Write data[0, bytes) to path with buffered I/O, returns 0 or -1 with errno set */
+int part_write_buffered(const char* path, const void* data, size_t bytes) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	int rc = part_write_fd(fd, (const char*)data, bytes);
+	if (close(fd) != 0) {
+		rc = -1;
+	}
+	return rc;
+}
+
+/* Write this rank's slice data[0, bytes), described by own, to
+ * <fwrpath>.<rank> and the manifest to fwrpath, collective over
+ * comm. Returns on rank 0 how many ranks wrote with O_DIRECT.
+ * If any rank's file or the manifest cannot be written, every
+ * rank exits.
+ */
+int part_write_all(const void* data, size_t bytes, struct part_entry* own, char* fwrpath, int direct, MPI_Comm comm) {
+	int rank, numranks;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &numranks);
+
+	char path[PART_PATH_MAX];
+	snprintf(path, sizeof(path), "%s.%05d", fwrpath, rank);
+
+	int used_direct = 0;
+	int rc = 1;
+	if (direct) {
+		rc = part_write_direct(path, data, bytes);
+		used_direct = (rc == 0);
+	}
+	if (rc == 1) {
+		rc = part_write_buffered(path, data, bytes);
+	}
+	int failed = (rc != 0);
+	if (failed) {
+		fprintf(stderr, "ERROR rank(%d): writing %s failed: %s\n", rank, path, strerror(errno));
+	}
+	/* Every rank fails together, before any rank waits in the gather */
+	int any_failed = 0;
+	MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, comm);
+	if (any_failed) {
+		exit(EXIT_FAILURE);
+	}
+
+	struct part_entry* all = NULL;
+	if (rank == 0) {
+		all = (struct part_entry*)malloc(numranks * sizeof(struct part_entry));
+		if (all == NULL) {
+			fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+	}
+	MPI_Gather(own, PART_ENTRY_WORDS, MPI_UINT64_T, all, PART_ENTRY_WORDS, MPI_UINT64_T, 0, comm);
+	int direct_ranks = 0;
+	MPI_Reduce(&used_direct, &direct_ranks, 1, MPI_INT, MPI_SUM, 0, comm);
+
+	int ok = 1;
+	if (rank == 0) {
+		FILE* f = fopen(fwrpath, "w");
+		ok = (f != NULL);
+		if (ok) {
+			fprintf(f, "# <path> <records> <first index> <min key> <max key> <rank>\n");
+			for (int i = 0; i < numranks; ++i) {
+				fprintf(f, "%s.%05d %llu %llu", fwrpath, i, (unsigned long long)all[i].records,
+						(unsigned long long)all[i].first);
+				if (all[i].records > 0) {
+					fprintf(f, " %lld %lld %d\n", (long long)all[i].min, (long long)all[i].max, i);
+				} else {
+					fprintf(f, " - - %d\n", i);
+				}
+			}
+			ok = (fclose(f) == 0);
+		}
+		if (!ok) {
+			fprintf(stderr, "ERROR rank(%d): writing manifest %s failed: %s\n", rank, fwrpath, strerror(errno));
+		}
+		free(all);
+	}
+	MPI_Bcast(&ok, 1, MPI_INT, 0, comm);
+	if (!ok) {
+		exit(EXIT_FAILURE);
+	}
+	return direct_ranks;
+}
+
+#endif
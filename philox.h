@@ -0,0 +1,73 @@
+/* Philox4x32-10 counter-based random number generator
+ * (Salmon et al., "Parallel Random Numbers: As Easy as
+ * 1, 2, 3", SC'11).
+ *
+ * Every call maps a 128 bit counter and a 64 bit key
+ * to 128 random bits with no state in between, so any
+ * element of a stream can be generated independently
+ * of the others, by any thread or rank.
+ */
+
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stdint.h>
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+#define PHILOX_ROUNDS 10
+
+typedef struct {
+	uint32_t v[4];
+} philox_ctr;
+
+typedef struct {
+	uint32_t v[2];
+} philox_key;
+
+philox_key philox_make_key(uint64_t seed) {
+	philox_key k;
+	k.v[0] = (uint32_t)seed;
+	k.v[1] = (uint32_t)(seed >> 32);
+	return k;
+}
+
+philox_ctr philox4x32(philox_ctr c, philox_key k) {
+	for (int i = 0; i < PHILOX_ROUNDS; ++i) {
+		uint64_t p0 = (uint64_t)PHILOX_M0 * c.v[0];
+		uint64_t p1 = (uint64_t)PHILOX_M1 * c.v[2];
+		philox_ctr n;
+		n.v[0] = (uint32_t)(p1 >> 32) ^ c.v[1] ^ k.v[0];
+		n.v[1] = (uint32_t)p1;
+		n.v[2] = (uint32_t)(p0 >> 32) ^ c.v[3] ^ k.v[1];
+		n.v[3] = (uint32_t)p0;
+		c = n;
+		k.v[0] += PHILOX_W0;
+		k.v[1] += PHILOX_W1;
+	}
+	return c;
+}
+
+/* 128 random bits for draw number `draw` of element `idx` */
+philox_ctr philox_draw(philox_key k, uint64_t idx, uint32_t draw) {
+	philox_ctr c;
+	c.v[0] = (uint32_t)idx;
+	c.v[1] = (uint32_t)(idx >> 32);
+	c.v[2] = draw;
+	c.v[3] = 0;
+	return philox4x32(c, k);
+}
+
+/* Uniform double in (0, 1] from 32 random bits */
+double philox_u01(uint32_t x) {
+	return ((double)x + 1.0) / 4294967296.0;
+}
+
+/* 64 random bits from two words */
+uint64_t philox_u64(uint32_t hi, uint32_t lo) {
+	return (((uint64_t)hi) << 32) | lo;
+}
+
+#endif
@@ -0,0 +1,252 @@
+/* Presortedness detection and fast paths.
+ *
+ * presort_try() scans every rank's slice once for its
+ * descents (adjacent pairs out of order), ascents, min
+ * and max, and gathers them on every rank, so all
+ * ranks take the same decision:
+ *
+ * -- noop: every slice is sorted and each starts at or
+ *    after the largest key before it. Nothing moves.
+ *
+ * -- fixup: every slice is made of ascending runs of at
+ *    least PRESORT_MIN_RUN keys on average (or is
+ *    descending) and only overlaps its neighbours' key
+ *    ranges. Each slice is sorted in place by a
+ *    natural merge (or reversed), then
+ *    neighbours trade just the keys in their overlap
+ *    (odd-even merge-split) until the order between
+ *    ranks is right, at most PRESORT_MAX_ROUNDS rounds.
+ *
+ * -- none: anything else, the caller sorts as usual.
+ *    Data is then still a permutation of the input.
+ *
+ * Slices stay where they are, rank order is output order.
+ */
+
+#ifndef PRESORT_H
+#define PRESORT_H
+
+#include <mpi.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include "serial_sort.h"
+
+/* Average run length from which a natural merge is used */
+#define PRESORT_MIN_RUN 64
+
+/* Merge-split rounds before giving up on the fixup */
+#define PRESORT_MAX_ROUNDS 8
+
+#define PRESORT_NONE  0
+#define PRESORT_NOOP  1
+#define PRESORT_FIXUP 2
+
+/* What one rank's slice looks like */
+struct presort_scan {
+	int64_t n;
+	int64_t descents;
+	int64_t ascents;
+	int64_t min;
+	int64_t max;
+};
+
+#define PRESORT_WORDS (sizeof(struct presort_scan) / sizeof(int64_t))
+
+/* Totals over the ranks, for the report */
+struct presort_stats {
+	int path;
+	int rounds;
+	uint64_t descents;
+	uint64_t unsorted_ranks;
+	uint64_t moved;
+};
+
+const char* presort_path_name(int path) {
+	switch (path) {
+		case PRESORT_NOOP: return "noop";
+		case PRESORT_FIXUP: return "fixup";
+		default: return "none";
+	}
+}
+
+void presort_scan_slice(const elem* data, size_t n, struct presort_scan* s) {
+	s->n = n;
+	s->descents = 0;
+	s->ascents = 0;
+	s->min = n > 0 ? data[0] : 0;
+	s->max = n > 0 ? data[0] : 0;
+	for (size_t i = 1; i < n; ++i) {
+		s->descents += (data[i] < data[i - 1]);
+		s->ascents += (data[i] > data[i - 1]);
+		s->min = data[i] < s->min ? data[i] : s->min;
+		s->max = data[i] > s->max ? data[i] : s->max;
+	}
+}
+
+/* Number of ranks whose first key is below the largest key before them */
+int presort_order_violations(elem* data, size_t n, MPI_Comm comm) {
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	int own_last = n > 0 ? data[n - 1] : INT_MIN;
+	int prev_last = INT_MIN;
+	MPI_Exscan(&own_last, &prev_last, 1, MPI_INT, MPI_MAX, comm);
+	int bad = (rank > 0 && n > 0 && data[0] < prev_last);
+	int total;
+	MPI_Allreduce(&bad, &total, 1, MPI_INT, MPI_SUM, comm);
+	return total;
+}
+
+/* Merge-split of two sorted neighbouring slices: the
+ * lower rank ends up with the smallest n of their keys.
+ * Only the keys in the overlap of the two are sent.
+ * Returns the number of keys this rank sent.
+ */
+size_t presort_merge_split(elem* data, size_t n, int partner, int lower, MPI_Comm comm) {
+	const int tag = 125;
+	int edge = lower ? data[n - 1] : data[0];
+	int other_edge;
+	MPI_Sendrecv(&edge, 1, MPI_INT, partner, tag, &other_edge, 1, MPI_INT, partner, tag, comm, MPI_STATUS_IGNORE);
+
+	/* lower sends its keys > partner's first, upper its keys < partner's last */
+	size_t from;
+	size_t to;
+	if (lower) {
+		from = n;
+		while (from > 0 && data[from - 1] > other_edge) {
+			--from;
+		}
+		to = n;
+	} else {
+		from = 0;
+		to = 0;
+		while (to < n && data[to] < other_edge) {
+			++to;
+		}
+	}
+
+	uint64_t send_n = to - from;
+	uint64_t recv_n;
+	MPI_Sendrecv(&send_n, 1, MPI_UINT64_T, partner, tag, &recv_n, 1, MPI_UINT64_T, partner, tag, comm,
+			MPI_STATUS_IGNORE);
+	if (send_n == 0 || recv_n == 0) {
+		return 0;
+	}
+
+	elem* merged = (elem*)malloc((send_n + recv_n) * sizeof(elem));
+	elem* other = (elem*)malloc(recv_n * sizeof(elem));
+	if (merged == NULL || other == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	MPI_Sendrecv(data + from, send_n, MPI_INT32_T, partner, tag, other, recv_n, MPI_INT32_T, partner, tag, comm,
+			MPI_STATUS_IGNORE);
+
+	const elem* a = data + from;
+	size_t x = 0;
+	size_t y = 0;
+	size_t o = 0;
+	while (x < send_n && y < recv_n) {
+		merged[o++] = other[y] < a[x] ? other[y++] : a[x++];
+	}
+	while (x < send_n) {
+		merged[o++] = a[x++];
+	}
+	while (y < recv_n) {
+		merged[o++] = other[y++];
+	}
+
+	/* Lower keeps the smallest, upper the largest, each as many as it sent */
+	memcpy(data + from, lower ? merged : merged + recv_n, send_n * sizeof(elem));
+	free(merged);
+	free(other);
+	return send_n;
+}
+
+/* Try the fast paths on data[0, n) of every rank of
+ * comm, collective. Returns the path taken; on
+ * PRESORT_NONE the caller still has to sort.
+ */
+int presort_try(elem* data, size_t n, MPI_Comm comm, struct presort_stats* stats) {
+	int rank, numranks;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &numranks);
+
+	struct presort_scan own;
+	presort_scan_slice(data, n, &own);
+	struct presort_scan* all = (struct presort_scan*)malloc(numranks * sizeof(struct presort_scan));
+	if (all == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	MPI_Allgather(&own, PRESORT_WORDS, MPI_INT64_T, all, PRESORT_WORDS, MPI_INT64_T, comm);
+
+	/* sorted: no descents and no overlap with the ranks before.
+	 * near: long runs and no overlap with the ranks before the previous one.
+	 */
+	int sorted = 1;
+	int near = 1;
+	int64_t before = INT64_MIN;
+	int64_t before_prev = INT64_MIN;
+	stats->descents = 0;
+	stats->unsorted_ranks = 0;
+	stats->moved = 0;
+	stats->rounds = 0;
+	for (int i = 0; i < numranks; ++i) {
+		stats->descents += all[i].descents;
+		stats->unsorted_ranks += (all[i].descents > 0);
+		if (all[i].n == 0) {
+			before_prev = before;
+			continue;
+		}
+		sorted = sorted && all[i].descents == 0 && all[i].min >= before;
+		int long_runs = (all[i].descents + 1) * PRESORT_MIN_RUN <= all[i].n || all[i].ascents == 0;
+		near = near && long_runs && all[i].min >= before_prev;
+		before_prev = before;
+		before = all[i].max > before ? all[i].max : before;
+	}
+	free(all);
+
+	if (sorted) {
+		stats->path = PRESORT_NOOP;
+		return PRESORT_NOOP;
+	}
+	stats->path = PRESORT_NONE;
+	if (!near) {
+		return PRESORT_NONE;
+	}
+
+	if (own.ascents == 0 && own.descents > 0) {
+		for (size_t i = 0; i < n / 2; ++i) {
+			swap(&data[i], &data[n - 1 - i]);
+		}
+	} else if (own.descents > 0) {
+		m_natural_merge_sort(data, data + n - 1);
+	}
+
+	uint64_t moved = 0;
+	while (presort_order_violations(data, n, comm) > 0) {
+		if (stats->rounds == PRESORT_MAX_ROUNDS) {
+			MPI_Allreduce(&moved, &stats->moved, 1, MPI_UINT64_T, MPI_SUM, comm);
+			return PRESORT_NONE;
+		}
+		/* Even rounds pair (0,1) (2,3) ..., odd rounds (1,2) (3,4) ... */
+		int lower = ((rank - stats->rounds) % 2 == 0);
+		int partner = lower ? rank + 1 : rank - 1;
+		if (partner >= 0 && partner < numranks) {
+			int has = (n > 0);
+			int partner_has;
+			MPI_Sendrecv(&has, 1, MPI_INT, partner, 126, &partner_has, 1, MPI_INT, partner, 126, comm,
+					MPI_STATUS_IGNORE);
+			if (has && partner_has) {
+				moved += presort_merge_split(data, n, partner, lower, comm);
+			}
+		}
+		stats->rounds += 1;
+	}
+	MPI_Allreduce(&moved, &stats->moved, 1, MPI_UINT64_T, MPI_SUM, comm);
+	stats->path = PRESORT_FIXUP;
+	return PRESORT_FIXUP;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Regression runs on one machine: make project generator && ./regress.sh
+# Every run must print VERIFY: PASSED, the script stops at the first one that does not.
+
+set -e
+
+MPIRUN=${MPIRUN:-mpirun}
+TMP=${TMPDIR:-/tmp}/hq-regress.$$
+mkdir -p $TMP
+trap "rm -rf $TMP" EXIT
+
+run() {
+  echo "== $*"
+  $MPIRUN "$@" | tee $TMP/log
+  grep -q "VERIFY: PASSED" $TMP/log
+}
+
+# All-equal keys leave every rank but one without keys after the first level,
+# so --shm gets empty window segments and --verify empty ranges
+./generator.out 0 1000 50001 allequal $TMP/allequal.bin
+for np in 2 4; do
+  run -np $np ./project.out $TMP/allequal.bin $TMP/out --shm --verify
+  run -np $np ./project.out $TMP/allequal.bin $TMP/out --shm --verify --aggregate
+done
@@ -14,6 +14,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* TYPES */
 typedef int elem;
@@ -130,6 +131,175 @@ elem findKth(elem* l, elem* r, size_t k) {
 	return *l;
 }
 
+/**
+ * Split a subarray about a pivot value into two
+ * newly allocated arrays, elements <= pv on the left
+ * and elements > pv on the right.
+ */
+void split_array(elem* l, elem* r, elem** l_arr, size_t* l_sz, elem** r_arr, size_t* r_sz, elem pv) {
+	size_t ls = 0;
+	size_t rs = 0;
+	
+	for (elem* it = l; it <= r; ++it) {
+		if (cmp(it, &pv) == 1) {
+			++rs;
+		} else {
+			++ls;
+		}
+	}
+	
+	*l_arr = (elem*)calloc(ls, sizeof(elem));
+	*r_arr = (elem*)calloc(rs, sizeof(elem));
+	elem* l_put = *l_arr;
+	elem* r_put = *r_arr;
+	for (elem* it = l; it <= r; ++it) {
+		if (cmp(it, &pv) == 1) {
+			*(r_put++) = *it;
+		} else {
+			*(l_put++) = *it;
+		}
+	}
+
+	*l_sz = ls;
+	*r_sz = rs;
+
+}
+
+/**
+ * Split a subarray about a pivot value in place.
+ * Elements <= pv end up before the returned pointer,
+ * elements > pv from it on.
+ */
+elem* split_in_place(elem* l, elem* r, elem pv) {
+	while (l <= r) {
+		if (*l <= pv) {
+			++l;
+		} else if (*r > pv) {
+			--r;
+		} else {
+			swap(l, r);
+			++l;
+			--r;
+		}
+	}
+	return l;
+}
+
+/**
+ * LSD radix sort of a subarray, one byte per pass.
+ * Passes where every key has the same byte are
+ * skipped. Falls back to m_qsort() when the scratch
+ * array cannot be allocated.
+ */
+void m_radix_sort(elem* l, elem* r) {
+	if (l >= r) { return; }
+	size_t n = r - l + 1;
+	unsigned int* src = (unsigned int*)l;
+	unsigned int* dst = (unsigned int*)malloc(n * sizeof(elem));
+	if (dst == NULL) {
+		m_qsort(l, r);
+		return;
+	}
+	unsigned int* scratch = dst;
+
+	/* Flip the sign bit so keys compare as unsigned */
+	for (size_t i = 0; i < n; ++i) {
+		src[i] ^= 0x80000000u;
+	}
+	for (int shift = 0; shift < 32; shift += 8) {
+		size_t count[256] = { 0 };
+		for (size_t i = 0; i < n; ++i) {
+			++count[(src[i] >> shift) & 0xFF];
+		}
+		if (count[(src[0] >> shift) & 0xFF] == n) {
+			continue;
+		}
+		size_t sum = 0;
+		for (int b = 0; b < 256; ++b) {
+			size_t c = count[b];
+			count[b] = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			dst[count[(src[i] >> shift) & 0xFF]++] = src[i];
+		}
+		unsigned int* t = src;
+		src = dst;
+		dst = t;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		((unsigned int*)l)[i] = src[i] ^ 0x80000000u;
+	}
+	free(scratch);
+}
+
+/**
+ * Natural merge sort of a subarray: the ascending
+ * runs already in it are merged pairwise until one
+ * is left, O(n log runs). Falls back to m_qsort()
+ * when the scratch array cannot be allocated.
+ */
+void m_natural_merge_sort(elem* l, elem* r) {
+	if (l >= r) { return; }
+	size_t n = r - l + 1;
+
+	/* Start of every run, plus n at the end */
+	size_t runs = 1;
+	for (size_t i = 1; i < n; ++i) {
+		runs += (l[i] < l[i - 1]);
+	}
+	if (runs == 1) { return; }
+	size_t* start = (size_t*)malloc((runs + 1) * sizeof(size_t));
+	elem* scratch = (elem*)malloc(n * sizeof(elem));
+	if (start == NULL || scratch == NULL) {
+		free(start);
+		free(scratch);
+		m_qsort(l, r);
+		return;
+	}
+	start[0] = 0;
+	for (size_t i = 1, k = 1; i < n; ++i) {
+		if (l[i] < l[i - 1]) {
+			start[k++] = i;
+		}
+	}
+	start[runs] = n;
+
+	elem* src = l;
+	elem* dst = scratch;
+	while (runs > 1) {
+		size_t k = 0;
+		for (size_t i = 0; i < runs; i += 2, ++k) {
+			size_t a = start[i];
+			size_t m = start[i + 1];
+			size_t b = i + 2 <= runs ? start[i + 2] : m;
+			size_t x = a;
+			size_t y = m;
+			size_t o = a;
+			while (x < m && y < b) {
+				dst[o++] = src[y] < src[x] ? src[y++] : src[x++];
+			}
+			while (x < m) {
+				dst[o++] = src[x++];
+			}
+			while (y < b) {
+				dst[o++] = src[y++];
+			}
+			start[k] = a;
+		}
+		start[k] = n;
+		runs = k;
+		elem* t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != l) {
+		memcpy(l, src, n * sizeof(elem));
+	}
+	free(start);
+	free(scratch);
+}
+
 #endif
 
 
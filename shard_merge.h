@@ -0,0 +1,433 @@
+/* Merge of already sorted shard files into one sorted file.
+ *
+ *   struct shard_set ss;
+ *   shard_open(&ss, paths, nshards, comm);
+ *   shard_merge(&ss, fwrpath, &stats, NULL, ends);
+ *   shard_close(&ss);
+ *
+ * Nothing is sorted. Rank r writes the keys at global
+ * positions [t(r), t(r + 1)) of the output, split like
+ * readfile() splits an input. It finds which prefix of
+ * every shard comes before t(r) (co-ranking) by a
+ * binary search over key values: the (t(r) + 1)th
+ * smallest key v is the smallest value with more than
+ * t(r) keys <= v over all shards, counted with a binary
+ * search in each shard. Keys equal to v are taken from
+ * the lowest shards first. Every probe only reads the
+ * keys it needs, through a small block cache per
+ * shard. Rank r + 1's start is rank r's end.
+ *
+ * Each rank then reads only its range of every shard,
+ * a block at a time, merges the shards with a loser
+ * tree and writes the output a block at a time while
+ * merging the next one. The data is read once and
+ * written once, and memory use does not depend on the
+ * size of the shards.
+ *
+ * Shards must be sorted files of elem, raw or written
+ * by index_write(). The merge is stable: equal keys
+ * keep the order of the shards.
+ */
+
+#ifndef SHARD_MERGE_H
+#define SHARD_MERGE_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "serial_sort.h"
+#include "mem_alloc.h"
+#include "verify.h"
+#include "index_file.h"
+
+/* Keys read at once by a probe of the co-ranking search */
+#define SHARD_CACHE_BLOCK 1024
+
+/* Keys per shard buffered by the merge, and per output block */
+#define SHARD_MERGE_BLOCK (1 << 16)
+
+/* Open sorted input files */
+struct shard_set {
+	int n;
+	MPI_File* fh;
+
+	/* Keys in each shard and in all of them, and where each shard's keys start */
+	uint64_t* sizes;
+	MPI_Offset* base;
+	uint64_t total;
+
+	/* One cached block of every shard for the co-ranking search */
+	elem* cache;
+	int64_t* cached;
+
+	/* Reads done by the co-ranking search of this rank */
+	uint64_t search_reads;
+};
+
+/* What one rank did, for the report */
+struct shard_merge_stats {
+	uint64_t keys;
+	uint64_t search_reads;
+	uint64_t block_reads;
+	uint64_t descents;
+	double corank_sec;
+	double merge_sec;
+};
+
+void shard_check(int rc, const char* what, int rank) {
+	if (rc != MPI_SUCCESS) {
+		char error_str[MPI_MAX_ERROR_STRING];
+		int errlen;
+		MPI_Error_string(rc, error_str, &errlen);
+		fprintf(stderr, "ERROR rank(%d): %s failed with error code (%d): %s\n", rank, what, rc, error_str);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Open the n shards in paths, collective over comm */
+void shard_open(struct shard_set* ss, char** paths, int n, MPI_Comm comm) {
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	ss->n = n;
+	ss->fh = (MPI_File*)malloc((n + 1) * sizeof(MPI_File));
+	ss->sizes = (uint64_t*)malloc((n + 1) * sizeof(uint64_t));
+	ss->base = (MPI_Offset*)malloc((n + 1) * sizeof(MPI_Offset));
+	ss->cache = (elem*)malloc(((size_t)n * SHARD_CACHE_BLOCK + 1) * sizeof(elem));
+	ss->cached = (int64_t*)malloc((n + 1) * sizeof(int64_t));
+	if (ss->fh == NULL || ss->sizes == NULL || ss->base == NULL || ss->cache == NULL || ss->cached == NULL) {
+		fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	ss->total = 0;
+	ss->search_reads = 0;
+	for (int s = 0; s < n; ++s) {
+		shard_check(MPI_File_open(comm, paths[s], MPI_MODE_RDONLY, MPI_INFO_NULL, &ss->fh[s]), "MPI_File_open(shard)",
+				rank);
+		MPI_Offset fsize;
+		shard_check(MPI_File_get_size(ss->fh[s], &fsize), "MPI_File_get_size(shard)", rank);
+		uint32_t flags;
+		index_data_range(ss->fh[s], fsize, &ss->base[s], &fsize, &flags);
+		ss->sizes[s] = fsize / sizeof(elem);
+		ss->total += ss->sizes[s];
+		ss->cached[s] = -1;
+	}
+}
+
+void shard_close(struct shard_set* ss) {
+	for (int s = 0; s < ss->n; ++s) {
+		MPI_File_close(&ss->fh[s]);
+	}
+	free(ss->fh);
+	free(ss->sizes);
+	free(ss->base);
+	free(ss->cache);
+	free(ss->cached);
+}
+
+/* Read keys [from, from + n) of shard s into buf */
+void shard_read(struct shard_set* ss, int s, uint64_t from, size_t n, elem* buf) {
+	int rank;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	shard_check(MPI_File_read_at(ss->fh[s], ss->base[s] + (MPI_Offset)(from * sizeof(elem)), buf, (int)n, MPI_INT32_T,
+			MPI_STATUS_IGNORE), "MPI_File_read_at(shard)", rank);
+}
+
+/* Key i of shard s, through the shard's cached block */
+elem shard_key(struct shard_set* ss, int s, uint64_t i) {
+	int64_t block = (int64_t)(i / SHARD_CACHE_BLOCK);
+	elem* cache = ss->cache + (size_t)s * SHARD_CACHE_BLOCK;
+	if (ss->cached[s] != block) {
+		uint64_t from = (uint64_t)block * SHARD_CACHE_BLOCK;
+		uint64_t n = ss->sizes[s] - from < SHARD_CACHE_BLOCK ? ss->sizes[s] - from : SHARD_CACHE_BLOCK;
+		shard_read(ss, s, from, n, cache);
+		ss->cached[s] = block;
+		ss->search_reads += 1;
+	}
+	return cache[i % SHARD_CACHE_BLOCK];
+}
+
+/* First index in [lo, hi) of shard s whose key is > v (or >= v
+ * when strict is 0), hi if there is none
+ */
+uint64_t shard_bound(struct shard_set* ss, int s, uint64_t lo, uint64_t hi, int64_t v, int strict) {
+	while (lo < hi) {
+		uint64_t m = lo + (hi - lo) / 2;
+		int64_t k = shard_key(ss, s, m);
+		if (strict ? k <= v : k < v) {
+			lo = m + 1;
+		} else {
+			hi = m;
+		}
+	}
+	return lo;
+}
+
+/* Co-rank global position t: pos[s] keys of shard s come
+ * before it, and the pos add up to t
+ */
+void shard_corank(struct shard_set* ss, uint64_t t, uint64_t* pos) {
+	if (t == 0 || t >= ss->total) {
+		for (int s = 0; s < ss->n; ++s) {
+			pos[s] = t == 0 ? 0 : ss->sizes[s];
+		}
+		return;
+	}
+
+	/* Keys <= v of shard s lie in [wlo[s], whi[s]] */
+	uint64_t* wlo = (uint64_t*)calloc(ss->n + 1, sizeof(uint64_t));
+	uint64_t* whi = (uint64_t*)malloc((ss->n + 1) * sizeof(uint64_t));
+	uint64_t* ub = (uint64_t*)malloc((ss->n + 1) * sizeof(uint64_t));
+	if (wlo == NULL || whi == NULL || ub == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	memcpy(whi, ss->sizes, ss->n * sizeof(uint64_t));
+
+	/* Smallest v with more than t keys <= v */
+	int64_t lo = INT_MIN;
+	int64_t hi = INT_MAX;
+	while (lo < hi) {
+		int64_t mid = lo + (hi - lo) / 2;
+		uint64_t le = 0;
+		for (int s = 0; s < ss->n; ++s) {
+			ub[s] = shard_bound(ss, s, wlo[s], whi[s], mid, 1);
+			le += ub[s];
+		}
+		uint64_t* narrowed = le > t ? whi : wlo;
+		memcpy(narrowed, ub, ss->n * sizeof(uint64_t));
+		if (le > t) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	/* All keys < v, then the missing ones from the copies of v, lowest shards first */
+	uint64_t less = 0;
+	for (int s = 0; s < ss->n; ++s) {
+		ub[s] = shard_bound(ss, s, wlo[s], whi[s], lo, 1);
+		pos[s] = shard_bound(ss, s, 0, ub[s], lo, 0);
+		less += pos[s];
+	}
+	uint64_t need = t - less;
+	for (int s = 0; s < ss->n; ++s) {
+		uint64_t take = ub[s] - pos[s] < need ? ub[s] - pos[s] : need;
+		pos[s] += take;
+		need -= take;
+	}
+	free(wlo);
+	free(whi);
+	free(ub);
+}
+
+/* One shard's range being merged */
+struct merge_source {
+	int shard;
+	uint64_t next;
+	uint64_t end;
+	elem* buf;
+	size_t head;
+	size_t len;
+};
+
+/* Source a goes before source b: smaller key, then lower shard, exhausted ones last */
+int merge_before(const struct merge_source* src, int a, int b) {
+	int a_done = src[a].head == src[a].len;
+	int b_done = src[b].head == src[b].len;
+	if (a_done || b_done) {
+		return !a_done || (b_done && a < b);
+	}
+	elem ka = src[a].buf[src[a].head];
+	elem kb = src[b].buf[src[b].head];
+	return ka < kb || (ka == kb && a < b);
+}
+
+/* Loser tree over k sources: tree[0] is the winner, tree[1, k) the
+ * loser of every match, leaf i sits at node k + i
+ */
+void loser_tree_build(const struct merge_source* src, int k, int* tree) {
+	int* win = (int*)malloc(2 * k * sizeof(int));
+	if (win == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	for (int i = 0; i < k; ++i) {
+		win[k + i] = i;
+	}
+	for (int node = k - 1; node >= 1; --node) {
+		int a = win[2 * node];
+		int b = win[2 * node + 1];
+		int a_wins = merge_before(src, a, b);
+		win[node] = a_wins ? a : b;
+		tree[node] = a_wins ? b : a;
+	}
+	tree[0] = k > 1 ? win[1] : 0;
+	free(win);
+}
+
+/* Replay the matches of source w after its head moved */
+void loser_tree_replay(const struct merge_source* src, int k, int* tree, int w) {
+	for (int node = (w + k) / 2; node > 0; node /= 2) {
+		if (merge_before(src, tree[node], w)) {
+			int t = tree[node];
+			tree[node] = w;
+			w = t;
+		}
+	}
+	tree[0] = w;
+}
+
+/* Refill the buffer of a source whose keys were all merged */
+void merge_refill(struct shard_set* ss, struct merge_source* m, struct shard_merge_stats* stats) {
+	elem last = m->len > 0 ? m->buf[m->len - 1] : INT_MIN;
+	int first = (m->len == 0);
+	m->head = 0;
+	m->len = m->end - m->next < SHARD_MERGE_BLOCK ? m->end - m->next : SHARD_MERGE_BLOCK;
+	if (m->len == 0) {
+		return;
+	}
+	shard_read(ss, m->shard, m->next, m->len, m->buf);
+	m->next += m->len;
+	stats->block_reads += 1;
+	for (size_t i = 0; i < m->len; ++i) {
+		stats->descents += (i > 0 ? m->buf[i] < m->buf[i - 1] : (!first && m->buf[0] < last));
+	}
+}
+
+/* Hash this rank's even slice of every shard into vs->before,
+ * split like readfile() splits an input and independent of the
+ * co-ranks, so the reduction checks that the ranks' merged
+ * ranges cover every shard exactly once. buf has room for
+ * SHARD_MERGE_BLOCK keys.
+ */
+void shard_hash_slices(struct shard_set* ss, struct verify_state* vs, elem* buf, int rank, int numranks) {
+	for (int s = 0; s < ss->n; ++s) {
+		uint64_t delta = ss->sizes[s] / numranks;
+		uint64_t from = delta * rank;
+		uint64_t end = rank + 1 == numranks ? ss->sizes[s] : from + delta;
+		for (; from < end; from += SHARD_MERGE_BLOCK) {
+			size_t len = end - from < SHARD_MERGE_BLOCK ? end - from : SHARD_MERGE_BLOCK;
+			shard_read(ss, s, from, len, buf);
+			for (size_t i = 0; i < len; ++i) {
+				multiset_hash_add(&vs->before, buf[i]);
+			}
+		}
+	}
+}
+
+/* Merge the shards into fwrpath, collective over MPI_COMM_WORLD.
+ * ends[0] and ends[1] get the first and last key this rank
+ * wrote (if stats->keys > 0). With vs, an even slice of
+ * every shard and the keys written are hashed into it for
+ * verify_finish().
+ */
+void shard_merge(struct shard_set* ss, char* fwrpath, struct shard_merge_stats* stats, struct verify_state* vs,
+		elem* ends) {
+	int rank, numranks;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &numranks);
+	const int tag = 127;
+	const int k = ss->n;
+
+	stats->block_reads = 0;
+	stats->descents = 0;
+	double t0 = MPI_Wtime();
+
+	/* This rank's range of the output, split like readfile() */
+	uint64_t delta = ss->total / numranks;
+	uint64_t start = delta * rank;
+	uint64_t end = rank + 1 == numranks ? ss->total : start + delta;
+	stats->keys = end - start;
+
+	uint64_t* from = (uint64_t*)malloc((k + 1) * sizeof(uint64_t));
+	uint64_t* to = (uint64_t*)malloc((k + 1) * sizeof(uint64_t));
+	if (from == NULL || to == NULL) {
+		fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	ss->search_reads = 0;
+	shard_corank(ss, start, from);
+	memcpy(to, ss->sizes, k * sizeof(uint64_t));
+	shard_check(MPI_Sendrecv(from, k, MPI_UINT64_T, rank > 0 ? rank - 1 : MPI_PROC_NULL, tag, to, k, MPI_UINT64_T,
+			rank + 1 < numranks ? rank + 1 : MPI_PROC_NULL, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE),
+			"MPI_Sendrecv(corank)", rank);
+	stats->search_reads = ss->search_reads;
+	stats->corank_sec = MPI_Wtime() - t0;
+
+	double t1 = MPI_Wtime();
+	struct merge_source* src = (struct merge_source*)malloc((k + 1) * sizeof(struct merge_source));
+	elem* bufs = (elem*)mem_alloc(((size_t)k + 2) * SHARD_MERGE_BLOCK * sizeof(elem));
+	int* tree = (int*)malloc((k + 1) * sizeof(int));
+	if (src == NULL || bufs == NULL || tree == NULL) {
+		fprintf(stderr, "ERROR rank(%d): malloc() failed\n", rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	if (vs != NULL) {
+		multiset_hash_init(&vs->before);
+		multiset_hash_init(&vs->after);
+		vs->unsorted = 0;
+	}
+	for (int s = 0; s < k; ++s) {
+		src[s].shard = s;
+		src[s].next = from[s];
+		src[s].end = to[s];
+		src[s].buf = bufs + (size_t)s * SHARD_MERGE_BLOCK;
+		src[s].len = 0;
+		merge_refill(ss, &src[s], stats);
+	}
+	loser_tree_build(src, k, tree);
+
+	MPI_File out;
+	shard_check(MPI_File_open(MPI_COMM_WORLD, fwrpath, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &out),
+			"MPI_File_open(output)", rank);
+	shard_check(MPI_File_set_size(out, 0), "MPI_File_set_size(output)", rank);
+
+	/* Two output blocks, one is written while the other fills */
+	elem* outbuf[2] = { bufs + (size_t)k * SHARD_MERGE_BLOCK, bufs + ((size_t)k + 1) * SHARD_MERGE_BLOCK };
+	MPI_Request writing = MPI_REQUEST_NULL;
+	int cur = 0;
+	size_t filled = 0;
+	uint64_t written = start;
+	for (uint64_t done = 0; done < stats->keys; ++done) {
+		struct merge_source* m = &src[tree[0]];
+		elem key = m->buf[m->head++];
+		if (vs != NULL) {
+			multiset_hash_add(&vs->after, key);
+			vs->unsorted += (done > 0 && key < ends[1]);
+		}
+		ends[0] = done == 0 ? key : ends[0];
+		ends[1] = key;
+		outbuf[cur][filled++] = key;
+		if (m->head == m->len) {
+			merge_refill(ss, m, stats);
+		}
+		loser_tree_replay(src, k, tree, tree[0]);
+
+		if (filled == SHARD_MERGE_BLOCK || done + 1 == stats->keys) {
+			shard_check(MPI_Wait(&writing, MPI_STATUS_IGNORE), "MPI_Wait(write)", rank);
+			shard_check(MPI_File_iwrite_at(out, (MPI_Offset)(written * sizeof(elem)), outbuf[cur], (int)filled,
+					MPI_INT32_T, &writing), "MPI_File_iwrite_at(output)", rank);
+			written += filled;
+			filled = 0;
+			cur = 1 - cur;
+		}
+	}
+	shard_check(MPI_Wait(&writing, MPI_STATUS_IGNORE), "MPI_Wait(write)", rank);
+	shard_check(MPI_File_close(&out), "MPI_File_close(output)", rank);
+	stats->merge_sec = MPI_Wtime() - t1;
+
+	if (vs != NULL) {
+		shard_hash_slices(ss, vs, outbuf[0], rank, numranks);
+	}
+
+	free(from);
+	free(to);
+	free(src);
+	free(tree);
+	mem_free(bufs);
+}
+
+#endif
@@ -0,0 +1,203 @@
+/* Local sort backends.
+ *
+ * A backend provides the three serial kernels the
+ * hypercube sort runs on each rank: the final sort,
+ * the selection of the local median and the split
+ * about the consensus median. All take inclusive
+ * [l, r] ranges like serial_sort.h.
+ *
+ *   quicksort  m_qsort, findKth, split_in_place
+ *   qsort      libc qsort
+ *   std        std::sort, std::nth_element, std::partition
+ *   radix      LSD radix sort, one byte per pass
+ *   cuda       odd-even network sort on the GPU, only
+ *              when compiled with -D CUDA_MODE
+ *
+ * sort_backend_autotune() times every backend on a
+ * sample of the local data of each rank and picks
+ * the one with the least total time over all ranks,
+ * so every rank ends up with the same backend.
+ */
+
+#ifndef SORT_BACKEND_H
+#define SORT_BACKEND_H
+
+#include <mpi.h>
+#include <string.h>
+#include "serial_sort.h"
+#include "cpp_sort_api.h"
+
+#ifdef CUDA_MODE
+#include "cuda_api.h"
+#endif
+
+struct sort_backend {
+	const char* name;
+
+	/* Sort [l, r] */
+	void (*sort)(elem* l, elem* r);
+
+	/* kth smallest of [l, r] counting from 1, may reorder it */
+	elem (*select)(elem* l, elem* r, size_t k);
+
+	/* Elements <= pv before the returned pointer, > pv from it on */
+	elem* (*partition)(elem* l, elem* r, elem pv);
+};
+
+/* Keys each rank sorts per backend in sort_backend_autotune() */
+#define SORT_BACKEND_SAMPLE (1 << 18)
+
+/* First sample size of sort_backend_autotune() */
+#define SORT_BACKEND_SAMPLE_MIN (1 << 12)
+
+/* Slowdown against the best at which a backend stops being timed */
+#define SORT_BACKEND_DROP 4
+
+/* Contiguous runs the sample is made of, to keep local order */
+#define SORT_BACKEND_SAMPLE_RUNS 8
+
+int sort_backend_qsort_cmp(const void* a, const void* b) {
+	return cmp((elem*)a, (elem*)b);
+}
+
+void sort_backend_qsort(elem* l, elem* r) {
+	if (l < r) {
+		qsort(l, r - l + 1, sizeof(elem), sort_backend_qsort_cmp);
+	}
+}
+
+#ifdef CUDA_MODE
+void sort_backend_cuda(elem* l, elem* r) {
+	static int device_set = 0;
+	if (!device_set) {
+		int world_rank, world_size;
+		MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+		MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+		CU_Init(world_rank, world_size);
+		device_set = 1;
+	}
+	CU_OddEvenNetworkSort(l, r);
+}
+#endif
+
+const struct sort_backend sort_backends[] = {
+	{ "quicksort", m_qsort, findKth, split_in_place },
+	{ "qsort", sort_backend_qsort, findKth, split_in_place },
+	{ "std", CPP_StdSort, CPP_NthElement, CPP_Partition },
+	{ "radix", m_radix_sort, CPP_NthElement, CPP_Partition },
+#ifdef CUDA_MODE
+	{ "cuda", sort_backend_cuda, findKth, split_in_place },
+#endif
+};
+
+#define NUM_SORT_BACKENDS ((int)(sizeof(sort_backends) / sizeof(sort_backends[0])))
+
+/* Backend used when none is chosen */
+#define SORT_BACKEND_DEFAULT (&sort_backends[0])
+
+/* Backend called name, NULL if there is none */
+const struct sort_backend* sort_backend_find(const char* name) {
+	for (int i = 0; i < NUM_SORT_BACKENDS; ++i) {
+		if (0 == strcmp(sort_backends[i].name, name)) {
+			return &sort_backends[i];
+		}
+	}
+	return NULL;
+}
+
+/* Seconds one backend took on keys sample keys, summed over the ranks */
+struct sort_backend_timing {
+	double seconds;
+	size_t keys;
+};
+
+/* Time every backend on a sample of data[0, n) of
+ * each rank, collective over comm. The sample grows
+ * from SORT_BACKEND_SAMPLE_MIN keys by 8x at a time
+ * and backends more than SORT_BACKEND_DROP times
+ * slower than the best are dropped on the way, so a
+ * backend that is quadratic on this data is only run
+ * on a small sample. The last timing of every backend
+ * is stored in times (NUM_SORT_BACKENDS) if not NULL.
+ */
+const struct sort_backend* sort_backend_autotune(const elem* data, size_t n, MPI_Comm comm,
+		struct sort_backend_timing* times) {
+	size_t max_n = n < SORT_BACKEND_SAMPLE ? n : SORT_BACKEND_SAMPLE;
+
+	/* Every rank runs the rounds of the largest sample, so all take part in each Allreduce */
+	uint64_t own_max = max_n;
+	uint64_t rounds_max = 0;
+	MPI_Allreduce(&own_max, &rounds_max, 1, MPI_UINT64_T, MPI_MAX, comm);
+	elem* sample = (elem*)malloc((max_n + 1) * sizeof(elem));
+	elem* work = (elem*)malloc((max_n + 1) * sizeof(elem));
+	if (sample == NULL || work == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+
+	int alive[NUM_SORT_BACKENDS];
+	struct sort_backend_timing last[NUM_SORT_BACKENDS];
+	for (int b = 0; b < NUM_SORT_BACKENDS; ++b) {
+		alive[b] = 1;
+		last[b].seconds = 0;
+		last[b].keys = 0;
+	}
+
+	int best = 0;
+	for (size_t round_n = SORT_BACKEND_SAMPLE_MIN; ; round_n *= 8) {
+		round_n = round_n < rounds_max ? round_n : rounds_max;
+		size_t sample_n = round_n < max_n ? round_n : max_n;
+
+		/* Runs spread evenly over the data */
+		size_t run = (sample_n + SORT_BACKEND_SAMPLE_RUNS - 1) / SORT_BACKEND_SAMPLE_RUNS;
+		for (size_t done = 0, i = 0; done < sample_n; done += run, ++i) {
+			size_t len = sample_n - done < run ? sample_n - done : run;
+			size_t from = n / SORT_BACKEND_SAMPLE_RUNS * i;
+			from = from + len > n ? n - len : from;
+			memcpy(sample + done, data + from, len * sizeof(elem));
+		}
+
+		double own[NUM_SORT_BACKENDS];
+		double total[NUM_SORT_BACKENDS];
+		for (int b = 0; b < NUM_SORT_BACKENDS; ++b) {
+			const struct sort_backend* be = &sort_backends[b];
+			own[b] = 0;
+			for (int rep = 0; alive[b] && rep < 2; ++rep) {
+				memcpy(work, sample, sample_n * sizeof(elem));
+				double t = MPI_Wtime();
+				if (sample_n > 0) {
+					elem pv = be->select(work, work + sample_n - 1, sample_n / 2);
+					be->partition(work, work + sample_n - 1, pv);
+					be->sort(work, work + sample_n - 1);
+				}
+				t = MPI_Wtime() - t;
+				own[b] = (rep == 0 || t < own[b]) ? t : own[b];
+			}
+		}
+		MPI_Allreduce(own, total, NUM_SORT_BACKENDS, MPI_DOUBLE, MPI_SUM, comm);
+
+		best = -1;
+		for (int b = 0; b < NUM_SORT_BACKENDS; ++b) {
+			if (alive[b]) {
+				last[b].seconds = total[b];
+				last[b].keys = sample_n;
+				best = (best < 0 || total[b] < total[best]) ? b : best;
+			}
+		}
+		for (int b = 0; b < NUM_SORT_BACKENDS; ++b) {
+			alive[b] = alive[b] && total[b] <= SORT_BACKEND_DROP * total[best];
+		}
+		if (round_n == rounds_max) {
+			break;
+		}
+	}
+	free(sample);
+	free(work);
+
+	if (times != NULL) {
+		memcpy(times, last, sizeof(last));
+	}
+	return &sort_backends[best];
+}
+
+#endif
@@ -0,0 +1,514 @@
+/* Hypercube sort of variable-length string keys.
+ *
+ *   struct str_set set;
+ *   str_read(&ctx, fname, &set);      (one key per line)
+ *   str_sort(&ctx, &set, &stats);
+ *   ... set holds this rank's keys, sorted and at global
+ *   byte offset stats.offset of the output
+ *
+ * The keys of a rank live in one arena; each key is
+ * an offset and a length, with its first STR_PREFIX
+ * bytes cached big-endian in a word next to them. Most
+ * comparisons are decided by that word without
+ * touching the arena.
+ *
+ * Comparisons of strings cost more than of ints, so
+ * each rank sorts once, first, with a multikey
+ * quicksort (three-way split on the byte at the
+ * current depth, taken from the cached prefix for the
+ * first 8 bytes). The levels then keep every rank
+ * sorted: the pivot is the median of the ranks'
+ * middle keys, gathered on the group leader and sent
+ * back as bytes. Each rank splits with a binary
+ * search and ships the partner its side packed as the
+ * lengths followed by the bytes, in one message after
+ * the sizes, and merges the kept and received keys
+ * into a fresh arena.
+ */
+
+#ifndef STR_SORT_H
+#define STR_SORT_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "hyperquicksort.h"
+#include "verify.h"
+
+/* Bytes of a key cached next to its offset */
+#define STR_PREFIX 8
+
+/* Keys below which the multikey quicksort switches to insertion sort */
+#define STR_INSERTION 16
+
+/* Bytes read at once while looking for a line end */
+#define STR_IO_BLOCK (1 << 16)
+
+/* Largest single message or file access, counts are ints */
+#define STR_CHUNK (1 << 30)
+
+struct str_ref {
+	/* First STR_PREFIX bytes, big-endian, zero padded */
+	uint64_t prefix;
+	uint64_t off;
+	uint64_t len;
+};
+
+/* Keys of one rank */
+struct str_set {
+	char* arena;
+	size_t bytes;
+	struct str_ref* refs;
+	size_t n;
+};
+
+/* What a sort did, for the report */
+struct str_stats {
+	/* Byte offset of this rank's output, keys ended by '\n' */
+	size_t offset;
+
+	/* Keys and bytes this rank sent over all levels, and messages */
+	uint64_t sent_keys;
+	uint64_t sent_bytes;
+	uint64_t messages;
+};
+
+uint64_t str_prefix(const char* s, size_t len) {
+	uint64_t p = 0;
+	for (int i = 0; i < STR_PREFIX; ++i) {
+		p = (p << 8) | (uint64_t)(i < (int)len ? (unsigned char)s[i] : 0);
+	}
+	return p;
+}
+
+/* Byte d of key r, -1 past its end */
+int str_char(const char* arena, const struct str_ref* r, size_t d) {
+	if (d >= r->len) {
+		return -1;
+	}
+	if (d < STR_PREFIX) {
+		return (int)((r->prefix >> (8 * (STR_PREFIX - 1 - d))) & 0xff);
+	}
+	return (unsigned char)arena[r->off + d];
+}
+
+/* Compare key a of arena_a with key b of arena_b like strcmp */
+int str_cmp(const char* arena_a, const struct str_ref* a, const char* arena_b, const struct str_ref* b) {
+	if (a->prefix != b->prefix) {
+		return a->prefix < b->prefix ? -1 : 1;
+	}
+	size_t common = a->len < b->len ? a->len : b->len;
+	if (common > STR_PREFIX) {
+		int c = memcmp(arena_a + a->off + STR_PREFIX, arena_b + b->off + STR_PREFIX, common - STR_PREFIX);
+		if (c != 0) {
+			return c;
+		}
+	}
+	return a->len < b->len ? -1 : (a->len > b->len ? 1 : 0);
+}
+
+void str_swap(struct str_ref* a, struct str_ref* b) {
+	struct str_ref t = *a;
+	*a = *b;
+	*b = t;
+}
+
+/* Multikey quicksort of a[0, n) whose keys share their first depth bytes */
+void str_mkqs(const char* arena, struct str_ref* a, size_t n, size_t depth) {
+	while (n > STR_INSERTION) {
+		/* Median of three bytes at depth */
+		int x = str_char(arena, &a[0], depth);
+		int y = str_char(arena, &a[n / 2], depth);
+		int z = str_char(arena, &a[n - 1], depth);
+		int v = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+
+		/* [0, lt) < v, [lt, gt) == v, [gt, n) > v */
+		size_t lt = 0;
+		size_t i = 0;
+		size_t gt = n;
+		while (i < gt) {
+			int c = str_char(arena, &a[i], depth);
+			if (c < v) {
+				str_swap(&a[lt++], &a[i++]);
+			} else if (c > v) {
+				str_swap(&a[i], &a[--gt]);
+			} else {
+				++i;
+			}
+		}
+		str_mkqs(arena, a, lt, depth);
+		str_mkqs(arena, a + gt, n - gt, depth);
+		if (v < 0) {
+			return;
+		}
+		a += lt;
+		n = gt - lt;
+		++depth;
+	}
+	for (size_t i = 1; i < n; ++i) {
+		struct str_ref t = a[i];
+		size_t j = i;
+		while (j > 0 && str_cmp(arena, &t, arena, &a[j - 1]) < 0) {
+			a[j] = a[j - 1];
+			--j;
+		}
+		a[j] = t;
+	}
+}
+
+/* Room for n keys of bytes bytes in set, keeping nothing */
+void str_reserve(struct str_set* set, size_t n, size_t bytes) {
+	free(set->arena);
+	free(set->refs);
+	set->arena = (char*)malloc(bytes + 1);
+	set->refs = (struct str_ref*)malloc((n + 1) * sizeof(struct str_ref));
+	if (set->arena == NULL || set->refs == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	set->bytes = 0;
+	set->n = 0;
+}
+
+void str_free(struct str_set* set) {
+	free(set->arena);
+	free(set->refs);
+	set->arena = NULL;
+	set->refs = NULL;
+	set->n = 0;
+	set->bytes = 0;
+}
+
+/* Append key s[0, len) to set, which has room for it */
+void str_push(struct str_set* set, const char* s, size_t len) {
+	struct str_ref* r = &set->refs[set->n++];
+	memcpy(set->arena + set->bytes, s, len);
+	r->off = set->bytes;
+	r->len = len;
+	r->prefix = str_prefix(s, len);
+	set->bytes += len;
+}
+
+/* First line end at or after byte from of fh, fsize if there is none */
+MPI_Offset str_line_end(MPI_File fh, MPI_Offset from, MPI_Offset fsize, int rank) {
+	char block[STR_IO_BLOCK];
+	for (; from < fsize; from += STR_IO_BLOCK) {
+		int n = fsize - from < STR_IO_BLOCK ? (int)(fsize - from) : STR_IO_BLOCK;
+		hq_check(MPI_File_read_at(fh, from, block, n, MPI_CHAR, MPI_STATUS_IGNORE), "MPI_File_read_at(line end)", rank);
+		char* nl = (char*)memchr(block, '\n', n);
+		if (nl != NULL) {
+			return from + (nl - block);
+		}
+	}
+	return fsize;
+}
+
+/* Read this rank's lines of fname into set, collective over
+ * ctx->comm. Ranks split the bytes evenly and each takes the
+ * lines starting in its share.
+ */
+void str_read(struct hq_context* ctx, char* fname, struct str_set* set) {
+	MPI_File fh;
+	hq_check(MPI_File_open(ctx->comm, fname, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh), "MPI_File_open(strings)", ctx->rank);
+	MPI_Offset fsize;
+	hq_check(MPI_File_get_size(fh, &fsize), "MPI_File_get_size(strings)", ctx->rank);
+
+	MPI_Offset delta = fsize / ctx->numranks;
+	MPI_Offset start = delta * ctx->rank;
+	MPI_Offset end = ctx->rank + 1 == ctx->numranks ? fsize : start + delta;
+	MPI_Offset begin = start == 0 ? 0 : str_line_end(fh, start - 1, fsize, ctx->rank) + 1;
+	MPI_Offset finish = end == 0 || end == fsize ? end : str_line_end(fh, end - 1, fsize, ctx->rank) + 1;
+	begin = begin < finish ? begin : finish;
+	finish = finish < fsize ? finish : fsize;
+
+	size_t bytes = finish - begin;
+	char* text = (char*)malloc(bytes + 1);
+	if (text == NULL) {
+		fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	for (size_t done = 0; done < bytes; done += STR_CHUNK) {
+		int chunk = bytes - done < STR_CHUNK ? (int)(bytes - done) : STR_CHUNK;
+		hq_check(MPI_File_read_at(fh, begin + done, text + done, chunk, MPI_CHAR, MPI_STATUS_IGNORE),
+				"MPI_File_read_at(strings)", ctx->rank);
+	}
+	hq_check(MPI_File_close(&fh), "MPI_File_close(strings)", ctx->rank);
+
+	size_t lines = 0;
+	for (size_t i = 0; i < bytes; ++i) {
+		lines += (text[i] == '\n' || i + 1 == bytes);
+	}
+	str_reserve(set, lines, bytes);
+	for (size_t i = 0; i < bytes;) {
+		char* nl = (char*)memchr(text + i, '\n', bytes - i);
+		size_t len = nl != NULL ? (size_t)(nl - (text + i)) : bytes - i;
+		str_push(set, text + i, len);
+		i += len + 1;
+	}
+	free(text);
+}
+
+/* Pick the pivot of a level: the median of the middle keys of
+ * the ranks that hold keys, into pivot (a set with one key)
+ */
+void str_consensus_median(struct hq_context* ctx, MPI_Comm comm, int localRank, int localNumranks,
+		const struct str_set* set, struct str_set* pivot) {
+	const struct str_ref* mid = set->n > 0 ? &set->refs[set->n / 2] : NULL;
+	int64_t own_len = mid != NULL ? (int64_t)mid->len : -1;
+	int64_t* lens = NULL;
+	int* counts = NULL;
+	int* displs = NULL;
+	char* all = NULL;
+	int total = 0;
+
+	if (localRank == 0) {
+		lens = (int64_t*)malloc(localNumranks * sizeof(int64_t));
+		counts = (int*)malloc(localNumranks * sizeof(int));
+		displs = (int*)malloc(localNumranks * sizeof(int));
+		if (lens == NULL || counts == NULL || displs == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+	}
+	hq_check(MPI_Gather(&own_len, 1, MPI_INT64_T, lens, 1, MPI_INT64_T, 0, comm), "MPI_Gather(median lengths)",
+			ctx->rank);
+	if (localRank == 0) {
+		for (int i = 0; i < localNumranks; ++i) {
+			counts[i] = lens[i] > 0 ? (int)lens[i] : 0;
+			displs[i] = total;
+			total += counts[i];
+		}
+		all = (char*)malloc(total + 1);
+	}
+	hq_check(MPI_Gatherv(mid != NULL ? set->arena + mid->off : NULL, own_len > 0 ? (int)own_len : 0, MPI_CHAR, all,
+			counts, displs, MPI_CHAR, 0, comm), "MPI_Gatherv(medians)", ctx->rank);
+
+	int64_t len = 0;
+	struct str_set medians = { NULL, 0, NULL, 0 };
+	const struct str_ref* chosen = NULL;
+	if (localRank == 0) {
+		str_reserve(&medians, localNumranks, total);
+		for (int i = 0; i < localNumranks; ++i) {
+			if (lens[i] >= 0) {
+				str_push(&medians, all + displs[i], lens[i]);
+			}
+		}
+		if (medians.n > 0) {
+			str_mkqs(medians.arena, medians.refs, medians.n, 0);
+			chosen = &medians.refs[medians.n / 2];
+			len = chosen->len;
+		}
+	}
+	hq_check(MPI_Bcast(&len, 1, MPI_INT64_T, 0, comm), "MPI_Bcast(pivot length)", ctx->rank);
+	str_reserve(pivot, 1, len);
+	if (localRank == 0 && chosen != NULL) {
+		memcpy(pivot->arena, medians.arena + chosen->off, len);
+	}
+	hq_check(MPI_Bcast(pivot->arena, (int)len, MPI_CHAR, 0, comm), "MPI_Bcast(pivot)", ctx->rank);
+
+	/* The bytes are in place already, only the key is added */
+	pivot->refs[0].off = 0;
+	pivot->refs[0].len = len;
+	pivot->refs[0].prefix = str_prefix(pivot->arena, len);
+	pivot->n = 1;
+	pivot->bytes = len;
+
+	str_free(&medians);
+	free(lens);
+	free(counts);
+	free(displs);
+	free(all);
+}
+
+/* Exchange send_bytes of send for recv_bytes into recv with src, in chunks of at most STR_CHUNK */
+uint64_t str_sendrecv(struct hq_context* ctx, MPI_Comm comm, int src, const char* send, size_t send_bytes, char* recv,
+		size_t recv_bytes) {
+	const int tag = 128;
+	uint64_t messages = 0;
+	for (size_t done = 0; done < send_bytes || done < recv_bytes; done += STR_CHUNK) {
+		int s = done < send_bytes ? (send_bytes - done < STR_CHUNK ? (int)(send_bytes - done) : STR_CHUNK) : 0;
+		int r = done < recv_bytes ? (recv_bytes - done < STR_CHUNK ? (int)(recv_bytes - done) : STR_CHUNK) : 0;
+		hq_check(MPI_Sendrecv(send + (s > 0 ? done : 0), s, MPI_BYTE, src, tag, recv + (r > 0 ? done : 0), r, MPI_BYTE,
+				src, tag, comm, MPI_STATUS_IGNORE), "MPI_Sendrecv(strings)", ctx->rank);
+		messages += (s > 0);
+	}
+	return messages;
+}
+
+/* Sort the keys of set over all ranks of ctx, see the top of the file */
+void str_sort(struct hq_context* ctx, struct str_set* set, struct str_stats* stats) {
+	const int tag = 129;
+	memset(stats, 0, sizeof(*stats));
+	str_mkqs(set->arena, set->refs, set->n, 0);
+
+	struct str_set pivot = { NULL, 0, NULL, 0 };
+	struct str_set next = { NULL, 0, NULL, 0 };
+	for (int level = 0; level < ctx->levels; ++level) {
+		MPI_Comm comm = ctx->level_comms[level];
+		int localNumranks = ctx->numranks >> level;
+		int localRank = ctx->rank % localNumranks;
+
+		str_consensus_median(ctx, comm, localRank, localNumranks, set, &pivot);
+
+		/* Keys <= pivot are [0, mid) */
+		size_t mid = 0;
+		size_t hi = set->n;
+		while (mid < hi) {
+			size_t m = mid + (hi - mid) / 2;
+			if (str_cmp(set->arena, &set->refs[m], pivot.arena, &pivot.refs[0]) <= 0) {
+				mid = m + 1;
+			} else {
+				hi = m;
+			}
+		}
+
+		const int color = (localRank >= (localNumranks >> 1));
+		int src_rank = color ? localRank - (localNumranks >> 1) : localRank + (localNumranks >> 1);
+		size_t keep_from = color ? mid : 0;
+		size_t keep_n = color ? set->n - mid : mid;
+		size_t send_from = color ? 0 : mid;
+		size_t send_n = color ? mid : set->n - mid;
+
+		/* Packed: the lengths as uint64, then the bytes */
+		size_t send_text = 0;
+		for (size_t i = send_from; i < send_from + send_n; ++i) {
+			send_text += set->refs[i].len;
+		}
+		size_t send_bytes = send_n * sizeof(uint64_t) + send_text;
+		char* packed = (char*)malloc(send_bytes + 1);
+		if (packed == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		uint64_t* lens = (uint64_t*)packed;
+		char* text = packed + send_n * sizeof(uint64_t);
+		for (size_t i = 0; i < send_n; ++i) {
+			const struct str_ref* r = &set->refs[send_from + i];
+			lens[i] = r->len;
+			memcpy(text, set->arena + r->off, r->len);
+			text += r->len;
+		}
+
+		uint64_t send_hdr[2] = { send_n, send_bytes };
+		uint64_t recv_hdr[2];
+		hq_check(MPI_Sendrecv(send_hdr, 2, MPI_UINT64_T, src_rank, tag, recv_hdr, 2, MPI_UINT64_T, src_rank, tag, comm,
+				MPI_STATUS_IGNORE), "MPI_Sendrecv(string sizes)", ctx->rank);
+		size_t recv_n = recv_hdr[0];
+		char* received = (char*)malloc(recv_hdr[1] + 1);
+		if (received == NULL) {
+			fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+			MPI_Abort(MPI_COMM_WORLD, 0);
+		}
+		stats->messages += 1 + str_sendrecv(ctx, comm, src_rank, packed, send_bytes, received, recv_hdr[1]);
+		stats->sent_keys += send_n;
+		stats->sent_bytes += send_bytes;
+		free(packed);
+
+		/* Merge the kept keys with the received ones into next */
+		const uint64_t* recv_lens = (const uint64_t*)received;
+		const char* recv_text = received + recv_n * sizeof(uint64_t);
+		size_t keep_text = 0;
+		for (size_t i = keep_from; i < keep_from + keep_n; ++i) {
+			keep_text += set->refs[i].len;
+		}
+		str_reserve(&next, keep_n + recv_n, keep_text + (recv_hdr[1] - recv_n * sizeof(uint64_t)));
+		size_t x = 0;
+		size_t y = 0;
+		uint64_t y_off = 0;
+		struct str_ref ry;
+		while (x < keep_n || y < recv_n) {
+			if (y < recv_n) {
+				ry.len = recv_lens[y];
+				ry.off = y_off;
+				ry.prefix = str_prefix(recv_text + y_off, ry.len);
+			}
+			const struct str_ref* rx = x < keep_n ? &set->refs[keep_from + x] : NULL;
+			if (y == recv_n || (rx != NULL && str_cmp(set->arena, rx, recv_text, &ry) <= 0)) {
+				str_push(&next, set->arena + rx->off, rx->len);
+				++x;
+			} else {
+				str_push(&next, recv_text + ry.off, ry.len);
+				y_off += ry.len;
+				++y;
+			}
+		}
+		free(received);
+
+		struct str_set tmp = *set;
+		*set = next;
+		next = tmp;
+	}
+	str_free(&next);
+	str_free(&pivot);
+
+	/* Output bytes: every key and its '\n' */
+	stats->offset = hq_offset(ctx, set->bytes + set->n);
+}
+
+/* 64 bit FNV-1a of a key, for the verification */
+uint64_t str_hash(const char* s, size_t len) {
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ (unsigned char)s[i]) * 0x100000001B3ULL;
+	}
+	return h;
+}
+
+/* Hash the keys of set into h */
+void str_hash_set(const struct str_set* set, struct multiset_hash* h) {
+	for (size_t i = 0; i < set->n; ++i) {
+		multiset_hash_add_u64(h, str_hash(set->arena + set->refs[i].off, set->refs[i].len));
+	}
+}
+
+/* Check after str_sort() that set is sorted within and across
+ * ranks and holds the keys hashed into vs->before. Collective.
+ */
+int str_verify(struct hq_context* ctx, const struct str_set* set, struct verify_state* vs) {
+	multiset_hash_init(&vs->after);
+	vs->unsorted = 0;
+	str_hash_set(set, &vs->after);
+	for (size_t i = 1; i < set->n; ++i) {
+		vs->unsorted += (str_cmp(set->arena, &set->refs[i - 1], set->arena, &set->refs[i]) > 0);
+	}
+
+	/* Every rank's last key, -1 for empty ranks */
+	int64_t own_len = set->n > 0 ? (int64_t)set->refs[set->n - 1].len : -1;
+	int64_t* lens = (int64_t*)malloc(ctx->numranks * sizeof(int64_t));
+	int* counts = (int*)malloc(ctx->numranks * sizeof(int));
+	int* displs = (int*)malloc(ctx->numranks * sizeof(int));
+	if (lens == NULL || counts == NULL || displs == NULL) {
+		fprintf(stderr, "ERROR RANK(%d): malloc() failed\n", ctx->rank);
+		MPI_Abort(MPI_COMM_WORLD, 0);
+	}
+	hq_check(MPI_Allgather(&own_len, 1, MPI_INT64_T, lens, 1, MPI_INT64_T, ctx->comm), "MPI_Allgather(last lengths)",
+			ctx->rank);
+	int total = 0;
+	for (int i = 0; i < ctx->numranks; ++i) {
+		counts[i] = lens[i] > 0 ? (int)lens[i] : 0;
+		displs[i] = total;
+		total += counts[i];
+	}
+	char* lasts = (char*)malloc(total + 1);
+	const struct str_ref* last = set->n > 0 ? &set->refs[set->n - 1] : NULL;
+	hq_check(MPI_Allgatherv(last != NULL ? set->arena + last->off : NULL, counts[ctx->rank], MPI_CHAR, lasts, counts,
+			displs, MPI_CHAR, ctx->comm), "MPI_Allgatherv(last keys)", ctx->rank);
+
+	int before = ctx->rank - 1;
+	while (before >= 0 && lens[before] < 0) {
+		--before;
+	}
+	if (set->n > 0 && before >= 0) {
+		struct str_ref prev = { str_prefix(lasts + displs[before], lens[before]), displs[before], lens[before] };
+		vs->unsorted += (str_cmp(lasts, &prev, set->arena, &set->refs[0]) > 0);
+	}
+	free(lens);
+	free(counts);
+	free(displs);
+	free(lasts);
+	return verify_combine(vs, ctx->comm);
+}
+
+#endif
@@ -0,0 +1,288 @@
+/* Hypercube quicksort with threads as ranks.
+ *
+ *   ts_sort(data, n, nthreads, backend, out, &stats);
+ *   ... out[0, n) is sorted
+ *
+ * For single-node runs: nthreads threads of one
+ * process (a power of 2) play the ranks of
+ * hq_sort_hypercube(). Thread t starts with slice t of
+ * data, cut like readfile() cuts an input. Every
+ * level, each thread posts its local median, all meet
+ * at a barrier and the threads of a group take the
+ * median of the posted medians as the pivot, without
+ * any message. Each thread splits the ranges it holds
+ * in place about the pivot and posts the split points.
+ * After a second barrier it keeps its own side of its
+ * ranges and takes the partner's ranges on that side,
+ * by pointer: no key moves between levels.
+ *
+ * A thread thus holds a list of ranges of data, at
+ * most nthreads of them at the end. The last step
+ * copies each thread's ranges to its offset in out
+ * and sorts them there, so every key is copied once,
+ * where the MPI exchange copies the moving half of
+ * the keys in and out of the transport on every level.
+ * Once a thread holds more than one range its local
+ * median is taken from an evenly spaced sample of
+ * TS_MEDIAN_SAMPLE keys of its ranges.
+ *
+ * Needs -pthread.
+ */
+
+#ifndef THREAD_SORT_H
+#define THREAD_SORT_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "serial_sort.h"
+#include "sort_backend.h"
+
+/* Keys the local median is taken from once a thread holds several ranges */
+#define TS_MEDIAN_SAMPLE 4096
+
+/* A part of data held by a thread */
+struct ts_range {
+	elem* l;
+	size_t n;
+
+	/* Keys <= pivot are [l, l + low) after the split */
+	size_t low;
+};
+
+/* What the threads post to each other */
+struct ts_slot {
+	/* Ranges held this level, nranges of them */
+	struct ts_range* ranges;
+	int nranges;
+
+	/* Local median, if the thread holds keys */
+	elem median;
+	int has;
+
+	/* Keys held after the last level */
+	size_t n;
+};
+
+/* What a sort did, for the report */
+struct ts_stats {
+	/* Keys copied between buffers */
+	uint64_t copied;
+
+	/* Most ranges a thread held */
+	int max_ranges;
+
+	/* Seconds of the levels and of the final copy and sort, slowest thread */
+	double split_sec;
+	double sort_sec;
+};
+
+struct ts_shared {
+	elem* data;
+	size_t n;
+	elem* out;
+	int nthreads;
+	int levels;
+	const struct sort_backend* backend;
+	pthread_barrier_t barrier;
+	struct ts_slot* slots;
+	struct ts_stats* stats;
+	pthread_mutex_t stats_lock;
+};
+
+struct ts_thread {
+	struct ts_shared* sh;
+	int t;
+};
+
+double ts_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Median of the keys of ranges[0, nranges), m keys in all. sample has room for TS_MEDIAN_SAMPLE keys. */
+elem ts_local_median(const struct sort_backend* backend, struct ts_range* ranges, int nranges, size_t m,
+		elem* sample) {
+	if (nranges == 1) {
+		return backend->select(ranges[0].l, ranges[0].l + m - 1, m / 2);
+	}
+	size_t take = m < TS_MEDIAN_SAMPLE ? m : TS_MEDIAN_SAMPLE;
+	size_t r = 0;
+	size_t before = 0;
+	for (size_t i = 0; i < take; ++i) {
+		/* Key i * m / take of the concatenated ranges */
+		size_t at = (size_t)((unsigned __int128)i * m / take);
+		while (at >= before + ranges[r].n) {
+			before += ranges[r].n;
+			++r;
+		}
+		sample[i] = ranges[r].l[at - before];
+	}
+	return backend->select(sample, sample + take - 1, take / 2);
+}
+
+void* ts_worker(void* arg) {
+	struct ts_thread* self = (struct ts_thread*)arg;
+	struct ts_shared* sh = self->sh;
+	const int t = self->t;
+	const int P = sh->nthreads;
+
+	struct ts_range* cur = (struct ts_range*)malloc((P + 1) * sizeof(struct ts_range));
+	struct ts_range* next = (struct ts_range*)malloc((P + 1) * sizeof(struct ts_range));
+	elem* sample = (elem*)malloc(TS_MEDIAN_SAMPLE * sizeof(elem));
+	elem* medians = (elem*)malloc((P + 1) * sizeof(elem));
+	if (cur == NULL || next == NULL || sample == NULL || medians == NULL) {
+		fprintf(stderr, "ERROR THREAD(%d): malloc() failed\n", t);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t delta = sh->n / P;
+	cur[0].l = sh->data + delta * t;
+	cur[0].n = t + 1 == P ? sh->n - delta * t : delta;
+	int ncur = cur[0].n > 0;
+	int max_ranges = ncur;
+	double start = ts_now();
+
+	for (int level = 0; level < sh->levels; ++level) {
+		int localNumranks = P >> level;
+		int localRank = t % localNumranks;
+		int group = t - localRank;
+		struct ts_slot* own = &sh->slots[t];
+
+		size_t m = 0;
+		for (int i = 0; i < ncur; ++i) {
+			m += cur[i].n;
+		}
+		own->has = (m > 0);
+		own->median = own->has ? ts_local_median(sh->backend, cur, ncur, m, sample) : 0;
+		pthread_barrier_wait(&sh->barrier);
+
+		/* Every thread of the group picks the same median of the posted medians */
+		int nmedians = 0;
+		for (int i = group; i < group + localNumranks; ++i) {
+			if (sh->slots[i].has) {
+				medians[nmedians++] = sh->slots[i].median;
+			}
+		}
+		elem pv = nmedians > 0 ? findKth(medians, medians + nmedians - 1, nmedians / 2) : 0;
+
+		for (int i = 0; i < ncur; ++i) {
+			elem* split = sh->backend->partition(cur[i].l, cur[i].l + cur[i].n - 1, pv);
+			cur[i].low = split - cur[i].l;
+		}
+		own->ranges = cur;
+		own->nranges = ncur;
+		pthread_barrier_wait(&sh->barrier);
+
+		/* Keep this side of the own and the partner's ranges */
+		const int color = (localRank >= (localNumranks >> 1));
+		int partner = color ? t - (localNumranks >> 1) : t + (localNumranks >> 1);
+		int nnext = 0;
+		for (int side = 0; side < 2; ++side) {
+			struct ts_slot* from = side == 0 ? own : &sh->slots[partner];
+			for (int i = 0; i < from->nranges; ++i) {
+				struct ts_range r = from->ranges[i];
+				struct ts_range kept = { color ? r.l + r.low : r.l, color ? r.n - r.low : r.low, 0 };
+				if (kept.n > 0) {
+					next[nnext++] = kept;
+				}
+			}
+		}
+		struct ts_range* tmp = cur;
+		cur = next;
+		next = tmp;
+		ncur = nnext;
+		max_ranges = ncur > max_ranges ? ncur : max_ranges;
+	}
+	double split_sec = ts_now() - start;
+
+	/* Offset of this thread's keys from the sizes of the threads before it */
+	size_t m = 0;
+	for (int i = 0; i < ncur; ++i) {
+		m += cur[i].n;
+	}
+	sh->slots[t].n = m;
+	pthread_barrier_wait(&sh->barrier);
+	size_t offset = 0;
+	for (int i = 0; i < t; ++i) {
+		offset += sh->slots[i].n;
+	}
+
+	start = ts_now();
+	elem* dst = sh->out + offset;
+	for (int i = 0; i < ncur; ++i) {
+		memcpy(dst, cur[i].l, cur[i].n * sizeof(elem));
+		dst += cur[i].n;
+	}
+	if (m > 0) {
+		sh->backend->sort(sh->out + offset, sh->out + offset + m - 1);
+	}
+	double sort_sec = ts_now() - start;
+
+	pthread_mutex_lock(&sh->stats_lock);
+	sh->stats->copied += m;
+	sh->stats->max_ranges = max_ranges > sh->stats->max_ranges ? max_ranges : sh->stats->max_ranges;
+	sh->stats->split_sec = split_sec > sh->stats->split_sec ? split_sec : sh->stats->split_sec;
+	sh->stats->sort_sec = sort_sec > sh->stats->sort_sec ? sort_sec : sh->stats->sort_sec;
+	pthread_mutex_unlock(&sh->stats_lock);
+
+	free(cur);
+	free(next);
+	free(sample);
+	free(medians);
+	return NULL;
+}
+
+/* Sort data[0, n) into out[0, n) with nthreads threads (a power
+ * of 2) and the kernels of backend. data is reordered.
+ */
+void ts_sort(elem* data, size_t n, int nthreads, const struct sort_backend* backend, elem* out,
+		struct ts_stats* stats) {
+	struct ts_shared sh;
+	sh.data = data;
+	sh.n = n;
+	sh.out = out;
+	sh.nthreads = nthreads;
+	sh.levels = 0;
+	while ((1 << sh.levels) < nthreads) {
+		++sh.levels;
+	}
+	sh.backend = backend;
+	sh.stats = stats;
+	memset(stats, 0, sizeof(*stats));
+
+	sh.slots = (struct ts_slot*)calloc(nthreads, sizeof(struct ts_slot));
+	struct ts_thread* threads = (struct ts_thread*)malloc(nthreads * sizeof(struct ts_thread));
+	pthread_t* ids = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+	if (sh.slots == NULL || threads == NULL || ids == NULL) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&sh.barrier, NULL, nthreads);
+	pthread_mutex_init(&sh.stats_lock, NULL);
+
+	for (int i = 0; i < nthreads; ++i) {
+		threads[i].sh = &sh;
+		threads[i].t = i;
+		if (pthread_create(&ids[i], NULL, ts_worker, &threads[i]) != 0) {
+			/* The started threads would wait at the first barrier forever */
+			fprintf(stderr, "ERROR: pthread_create() failed after %d of %d threads\n", i, nthreads);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(ids[i], NULL);
+	}
+
+	pthread_barrier_destroy(&sh.barrier);
+	pthread_mutex_destroy(&sh.stats_lock);
+	free(sh.slots);
+	free(threads);
+	free(ids);
+}
+
+#endif
@@ -0,0 +1,222 @@
+/* One pass verification of a distributed sort.
+ *
+ * Each rank hashes its keys before the sort and
+ * hashes them again while checking that they are
+ * in order after the sort. The hashes are order
+ * independent (a sum, an xor of mixed keys and the
+ * product of (Z - key) modulo the Mersenne prime
+ * 2^61 - 1), so the input and output agree exactly
+ * when they are the same multiset, with very high
+ * probability. The order between ranks is checked
+ * by comparing each rank's first key with the
+ * largest key held by the ranks before it.
+ *
+ * Everything is combined with one MPI_Allreduce.
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <mpi.h>
+#include <stdint.h>
+#include <limits.h>
+#include "serial_sort.h"
+
+#define VERIFY_P61 ((1ULL << 61) - 1)
+
+/* Evaluation point of the product, larger than any key */
+#define VERIFY_Z 0x1D2B3C4D5E6F7081ULL
+
+/* Order independent hash of a multiset of keys */
+struct multiset_hash {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t xor;
+	uint64_t poly;
+};
+
+/* Everything one rank contributes to the verification */
+struct verify_state {
+	struct multiset_hash before;
+	struct multiset_hash after;
+	uint64_t unsorted;
+};
+
+#define VERIFY_WORDS (sizeof(struct verify_state) / sizeof(uint64_t))
+
+uint64_t verify_mulmod61(uint64_t a, uint64_t b) {
+	unsigned __int128 p = (unsigned __int128)a * b;
+	uint64_t r = (uint64_t)(p & VERIFY_P61) + (uint64_t)(p >> 61);
+	return r >= VERIFY_P61 ? r - VERIFY_P61 : r;
+}
+
+/* splitmix64 finalizer, spreads keys before they are xor-ed */
+uint64_t verify_mix(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+void multiset_hash_init(struct multiset_hash* h) {
+	h->count = 0;
+	h->sum = 0;
+	h->xor = 0;
+	h->poly = 1;
+}
+
+void multiset_hash_add(struct multiset_hash* h, elem key) {
+	uint64_t k = (uint64_t)((int64_t)key - INT_MIN);
+	h->count += 1;
+	h->sum += k;
+	h->xor ^= verify_mix(k);
+	h->poly = verify_mulmod61(h->poly, (VERIFY_Z - k) % VERIFY_P61);
+}
+
+/* Same as count calls of multiset_hash_add(h, key) */
+void multiset_hash_add_n(struct multiset_hash* h, elem key, uint64_t count) {
+	uint64_t k = (uint64_t)((int64_t)key - INT_MIN);
+	h->count += count;
+	h->sum += k * count;
+	h->xor ^= (count & 1) ? verify_mix(k) : 0;
+	uint64_t base = (VERIFY_Z - k) % VERIFY_P61;
+	for (uint64_t e = count; e > 0; e >>= 1) {
+		if (e & 1) {
+			h->poly = verify_mulmod61(h->poly, base);
+		}
+		base = verify_mulmod61(base, base);
+	}
+}
+
+/* Add a 64 bit value, e.g. the hash of a string key */
+void multiset_hash_add_u64(struct multiset_hash* h, uint64_t k) {
+	uint64_t r = k % VERIFY_P61;
+	h->count += 1;
+	h->sum += k;
+	h->xor ^= verify_mix(k);
+	h->poly = verify_mulmod61(h->poly, (VERIFY_Z % VERIFY_P61 + VERIFY_P61 - r) % VERIFY_P61);
+}
+
+void multiset_hash_combine(struct multiset_hash* into, const struct multiset_hash* from) {
+	into->count += from->count;
+	into->sum += from->sum;
+	into->xor ^= from->xor;
+	into->poly = verify_mulmod61(into->poly, from->poly);
+}
+
+int multiset_hash_equal(const struct multiset_hash* a, const struct multiset_hash* b) {
+	return a->count == b->count && a->sum == b->sum && a->xor == b->xor && a->poly == b->poly;
+}
+
+/* Hash the keys of [l, r] before the sort */
+void verify_before(struct verify_state* vs, const elem* l, const elem* r) {
+	multiset_hash_init(&vs->before);
+	multiset_hash_init(&vs->after);
+	vs->unsorted = 0;
+	for (const elem* it = l; it <= r; ++it) {
+		multiset_hash_add(&vs->before, *it);
+	}
+}
+
+/* Hash the keys of [l, r] after the sort, counting descents */
+void verify_after(struct verify_state* vs, const elem* l, const elem* r) {
+	for (const elem* it = l; it <= r; ++it) {
+		multiset_hash_add(&vs->after, *it);
+		vs->unsorted += (it > l && *it < *(it - 1));
+	}
+}
+
+/* Hash the keys of n runs (keys[i * stride] occurring counts[i * stride]
+ * times) after an aggregation, counting runs whose key does not
+ * increase. A key may only repeat after a run with a full count.
+ */
+void verify_after_runs(struct verify_state* vs, const elem* keys, const uint32_t* counts, size_t n, size_t stride) {
+	for (size_t i = 0; i < n; ++i) {
+		multiset_hash_add_n(&vs->after, keys[i * stride], counts[i * stride]);
+		if (i > 0) {
+			elem prev = keys[(i - 1) * stride];
+			int full = (counts[(i - 1) * stride] == UINT32_MAX);
+			vs->unsorted += (keys[i * stride] < prev || (keys[i * stride] == prev && !full));
+		}
+	}
+}
+
+/* Runs on whole struct verify_state elements of the contiguous type made in verify_combine() */
+void verify_reduce_op(void* in, void* inout, int* len, MPI_Datatype* dtype) {
+	struct verify_state* a = (struct verify_state*)in;
+	struct verify_state* b = (struct verify_state*)inout;
+	for (int i = 0; i < *len; ++i) {
+		multiset_hash_combine(&b[i].before, &a[i].before);
+		multiset_hash_combine(&b[i].after, &a[i].after);
+		b[i].unsorted += a[i].unsorted;
+	}
+}
+
+/* Combine the states of all ranks of comm, once the order
+ * between ranks has been added to vs->unsorted. Returns 1
+ * if the output is a sorted permutation of the input.
+ */
+int verify_combine(struct verify_state* vs, MPI_Comm comm) {
+	int rc;
+	char error_str[MPI_MAX_ERROR_STRING];
+	int errlen;
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+
+	MPI_Datatype type;
+	MPI_Type_contiguous(VERIFY_WORDS, MPI_UINT64_T, &type);
+	MPI_Type_commit(&type);
+	MPI_Op op;
+	MPI_Op_create(verify_reduce_op, 1, &op);
+	struct verify_state total;
+	rc = MPI_Allreduce(vs, &total, 1, type, op, comm);
+	if (rc != MPI_SUCCESS) {
+		MPI_Error_string(rc, error_str, &errlen);
+		fprintf(stderr, "ERROR RANK(%d): MPI_Allreduce(verify) failed with error code(%d): %s\n", rank, rc, error_str);
+		MPI_Abort(MPI_COMM_WORLD, rc);
+	}
+	MPI_Op_free(&op);
+	MPI_Type_free(&type);
+
+	if (rank == 0) {
+		if (total.unsorted != 0) {
+			fprintf(stderr, "VERIFY: FAILED, %llu keys out of order\n", (unsigned long long)total.unsorted);
+		}
+		if (!multiset_hash_equal(&total.before, &total.after)) {
+			fprintf(stderr, "VERIFY: FAILED, output is not a permutation of the input (%llu keys in, %llu keys out)\n",
+					(unsigned long long)total.before.count, (unsigned long long)total.after.count);
+		}
+	}
+	return total.unsorted == 0 && multiset_hash_equal(&total.before, &total.after);
+}
+
+/* Finish the verification over comm after verify_after().
+ * [l, r] is the sorted range this rank holds, ranks are in
+ * output order. Returns 1 if the output is a sorted
+ * permutation of the input on every rank, 0 otherwise.
+ */
+int verify_finish(struct verify_state* vs, const elem* l, const elem* r, MPI_Comm comm) {
+	int rc;
+	char error_str[MPI_MAX_ERROR_STRING];
+	int errlen;
+
+	/* Largest key before this rank; empty ranks pass it on */
+	int has_elems = (l <= r);
+	int own_last = has_elems ? *r : INT_MIN;
+	int prev_last = INT_MIN;
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+
+	rc = MPI_Exscan(&own_last, &prev_last, 1, MPI_INT, MPI_MAX, comm);
+	if (rc != MPI_SUCCESS) {
+		MPI_Error_string(rc, error_str, &errlen);
+		fprintf(stderr, "ERROR RANK(%d): MPI_Exscan() failed with error code(%d): %s\n", rank, rc, error_str);
+		MPI_Abort(MPI_COMM_WORLD, rc);
+	}
+	if (rank > 0 && has_elems && *l < prev_last) {
+		vs->unsorted += 1;
+	}
+	return verify_combine(vs, comm);
+}
+
+#endif